@@ -0,0 +1,31 @@
+#include "alloc_counter.hh"
+
+#include <atomic>
+#include <cstddef>
+
+// Count the allocations by interposing malloc(). The definition in the
+// executable takes precedence over the one in libc for every shared library,
+// libzmq included, and the real allocation is forwarded to glibc.
+
+namespace {
+
+std::atomic<std::uint64_t> n_allocations {0};
+
+}
+
+extern "C" {
+
+void* __libc_malloc(std::size_t size);
+
+void* malloc(std::size_t size)
+{
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+}
+
+std::uint64_t allocation_count()
+{
+    return n_allocations.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstdint>
+
+// Number of calls to malloc() made by the whole process so far, including
+// libzmq and its I/O threads.
+std::uint64_t allocation_count();
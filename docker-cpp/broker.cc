@@ -0,0 +1,110 @@
+#include "broker.hh"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace {
+
+// The workers check for shutdown this often when they have nothing to do.
+constexpr int WORKER_POLL_INTERVAL_MS = 100;
+
+std::string inproc_endpoint(const char* name, const void* broker)
+{
+    return "inproc://" + std::string {name} + "-" +
+        std::to_string(reinterpret_cast<std::uintptr_t>(broker));
+}
+
+// A REP socket only lets the reply be sent once the whole request has been
+// received, so all the parts are collected first. Returns false if no
+// request arrived before the timeout. The parts of a multipart message are
+// delivered together, so only the first one can time out.
+bool receive_request(zmq::socket_t& socket, std::vector<zmq::message_t>& parts)
+{
+    parts.clear();
+    do {
+        parts.emplace_back();
+        if (!socket.recv(parts.back(), zmq::recv_flags::none)) {
+            return false;
+        }
+    } while (parts.back().more());
+    return true;
+}
+
+}
+
+Broker::Broker(zmq::context_t& ctx, const BrokerOptions& options) :
+    ctx {ctx},
+    options {options},
+    backend_endpoint {inproc_endpoint("backend", this)},
+    control_endpoint {inproc_endpoint("control", this)},
+    frontend {ctx, zmq::socket_type::router},
+    backend {ctx, zmq::socket_type::dealer},
+    control {ctx, zmq::socket_type::pair}
+{
+    // The high water marks must be set before binding. They limit how many
+    // messages queue up per peer before the broker pushes back.
+    for (auto* socket : {&frontend, &backend}) {
+        socket->setsockopt(ZMQ_SNDHWM, options.hwm);
+        socket->setsockopt(ZMQ_RCVHWM, options.hwm);
+        socket->setsockopt(ZMQ_LINGER, 0);
+    }
+    frontend.bind(options.endpoint);
+    backend.bind(backend_endpoint);
+
+    // The proxy can be told to terminate over the control socket. The other
+    // end of the pair is created here, but only used by the proxy thread.
+    zmq::socket_t proxy_control {ctx, zmq::socket_type::pair};
+    proxy_control.bind(control_endpoint);
+    control.connect(control_endpoint);
+
+    for (auto i = 0; i < options.workers; ++i) {
+        workers.emplace_back(&Broker::run_worker, this);
+    }
+    proxy = std::thread {
+        [this, proxy_control = std::move(proxy_control)]() mutable {
+            zmq::proxy_steerable(frontend, backend, zmq::socket_ref {}, proxy_control);
+        }};
+}
+
+Broker::~Broker()
+{
+    stop();
+}
+
+std::uint64_t Broker::stop()
+{
+    if (!stopping.exchange(true)) {
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        control.send(zmq::buffer("TERMINATE", 9), zmq::send_flags::none);
+        proxy.join();
+    }
+    return n_messages;
+}
+
+void Broker::run_worker()
+{
+    zmq::socket_t socket {ctx, zmq::socket_type::rep};
+    socket.setsockopt(ZMQ_SNDHWM, options.hwm);
+    socket.setsockopt(ZMQ_RCVHWM, options.hwm);
+    socket.setsockopt(ZMQ_RCVTIMEO, WORKER_POLL_INTERVAL_MS);
+    socket.setsockopt(ZMQ_LINGER, 0);
+    socket.connect(backend_endpoint);
+
+    // The vector keeps its capacity between requests, so a worker doesn't
+    // allocate once it has seen the largest batch.
+    std::vector<zmq::message_t> parts;
+    std::uint64_t n_served = 0;
+    while (!stopping.load(std::memory_order_relaxed)) {
+        if (!receive_request(socket, parts)) {
+            continue;
+        }
+        for (auto i = std::size_t {}; i < parts.size(); ++i) {
+            const auto flags = i + 1 < parts.size() ? zmq::send_flags::sndmore : zmq::send_flags::none;
+            socket.send(parts[i], flags);
+        }
+        ++n_served;
+    }
+    n_messages += n_served;
+}
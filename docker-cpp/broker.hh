@@ -0,0 +1,47 @@
+#pragma once
+
+#include <zmq.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct BrokerOptions {
+    std::string endpoint {"tcp://*:9999"};
+    int workers {4};
+    int hwm {1000};
+};
+
+// Echo server that spreads the requests over a pool of worker threads. The
+// clients talk to a ROUTER socket, which is proxied to a DEALER socket that
+// the workers connect to over inproc://. The broker doesn't own the context,
+// so that the I/O threads can be tuned by the caller, and an embedded broker
+// can share the context with inproc:// clients.
+class Broker {
+public:
+    Broker(zmq::context_t& ctx, const BrokerOptions& options);
+    Broker(const Broker&) = delete;
+    Broker& operator=(const Broker&) = delete;
+    ~Broker();
+
+    // Let the workers finish the request they're handling, then stop the
+    // workers and the proxy. Returns the number of messages served.
+    std::uint64_t stop();
+
+private:
+    void run_worker();
+
+    zmq::context_t& ctx;
+    const BrokerOptions options;
+    const std::string backend_endpoint;
+    const std::string control_endpoint;
+    zmq::socket_t frontend;
+    zmq::socket_t backend;
+    zmq::socket_t control;
+    std::atomic<bool> stopping {false};
+    std::atomic<std::uint64_t> n_messages {0};
+    std::vector<std::thread> workers;
+    std::thread proxy;
+};
@@ -0,0 +1,45 @@
+#include "buffer_pool.hh"
+
+#include <cstdlib>
+#include <new>
+
+BufferPool::BufferPool(std::size_t buffer_size, std::size_t initial_buffers) :
+    buffer_size {buffer_size}
+{
+    free_buffers.reserve(initial_buffers);
+    for (auto i = std::size_t {}; i < initial_buffers; ++i) {
+        free_buffers.push_back(::operator new(buffer_size));
+    }
+    n_heap_allocations = initial_buffers;
+}
+
+BufferPool::~BufferPool()
+{
+    for (const auto buffer : free_buffers) {
+        ::operator delete(buffer);
+    }
+}
+
+void* BufferPool::acquire()
+{
+    const auto lock = std::lock_guard {mutex};
+    if (!free_buffers.empty()) {
+        const auto buffer = free_buffers.back();
+        free_buffers.pop_back();
+        return buffer;
+    }
+    // Make room in the free list for the new buffer now, so that release()
+    // never has to grow it.
+    free_buffers.reserve(++n_heap_allocations);
+    return ::operator new(buffer_size);
+}
+
+void BufferPool::release(void* data, void* hint)
+{
+    // This is the free function given to zmq_msg_init_data(). The free list
+    // has room for every buffer that was ever allocated, so pushing doesn't
+    // allocate once the pool has warmed up.
+    auto& pool = *static_cast<BufferPool*>(hint);
+    const auto lock = std::lock_guard {pool.mutex};
+    pool.free_buffers.push_back(data);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <zmq.hpp>
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Pool of fixed size buffers for building zero-copy messages. The message
+// takes ownership of the buffer, and libzmq hands it back to the pool when it
+// is done with it, possibly from one of its I/O threads. The pool must
+// therefore outlive the context the messages are sent through.
+class BufferPool {
+public:
+    explicit BufferPool(std::size_t buffer_size, std::size_t initial_buffers = 0);
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    ~BufferPool();
+
+    // libzmq stores messages up to this size inside zmq_msg_t itself (33
+    // bytes with the 64 byte zmq_msg_t of 64 bit platforms).
+    static constexpr std::size_t MAX_INLINE_SIZE = 33;
+
+    // Build a message of size bytes. fill(data, size) writes the payload
+    // straight into the pooled buffer, so the payload is never copied.
+    //
+    // Wrapping a buffer makes libzmq allocate a reference count for it, so a
+    // small payload is cheaper to copy into an inline message, which doesn't
+    // allocate at all.
+    template<typename Fill>
+    zmq::message_t make_message(std::size_t size, Fill&& fill)
+    {
+        assert(size <= buffer_size);
+        if (size <= MAX_INLINE_SIZE) {
+            char data[MAX_INLINE_SIZE];
+            fill(data, size);
+            return zmq::message_t {data, size};
+        }
+        const auto data = acquire();
+        fill(data, size);
+        return zmq::message_t {data, size, &BufferPool::release, this};
+    }
+
+    std::size_t get_buffer_size() const { return buffer_size; }
+    std::uint64_t heap_allocations() const { return n_heap_allocations; }
+
+private:
+    void* acquire();
+    static void release(void* data, void* hint);
+
+    const std::size_t buffer_size;
+    std::mutex mutex;
+    std::vector<void*> free_buffers;
+    std::atomic<std::uint64_t> n_heap_allocations {0};
+};
@@ -1,21 +1,315 @@
+#include "alloc_counter.hh"
+#include "broker.hh"
+#include "buffer_pool.hh"
+
 #include <zmq.hpp>
 
-#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
 
 const char message[] {"Hello, world!"};
 
-int main()
+// While the benchmark runs, a connection waiting for a reply checks this
+// often whether it has ended. After that, it gives up on a reply still in
+// flight if it doesn't arrive in DRAIN_TIMEOUT, or in twice the slowest
+// round trip so far if that is longer.
+constexpr int POLL_INTERVAL_MS = 100;
+constexpr auto DRAIN_TIMEOUT = std::chrono::seconds {1};
+
+struct ClientOptions {
+    std::string endpoint {"tcp://server:9999"};
+    int connections {1};
+    int depth {1};
+    std::size_t size {sizeof(message) - 1};
+    int batch {1};
+    bool pooled {false};
+    int duration {0};
+};
+
+// What one connection measured.
+struct ConnectionResult {
+    std::uint64_t n_messages {0};
+    std::vector<std::int64_t> latencies;
+    Clock::duration slowest {};
+    bool completed {false};
+};
+
+// Stands in for the application producing the payload, e.g. serializing a
+// request. The message is repeated to fill the requested size.
+void fill_payload(void* data, std::size_t size)
+{
+    const auto bytes = static_cast<char*>(data);
+    for (auto i = std::size_t {}; i < size; i += sizeof(message) - 1) {
+        std::memcpy(bytes + i, message, std::min(sizeof(message) - 1, size - i));
+    }
+}
+
+// A request is sent as a multipart message: an empty delimiter frame that
+// makes the DEALER socket speak the REQ/REP envelope protocol, the time the
+// request was sent, and one frame for each message in the batch. The server
+// echoes all of it back, so the latency can be computed from the reply
+// without keeping track of the requests in flight. pool is null unless the
+// messages are built from pooled buffers.
+void send_request(
+    zmq::socket_t& socket, const ClientOptions& options, BufferPool* pool,
+    std::vector<char>& scratch)
 {
-    zmq::context_t ctx;
-    zmq::socket_t socket {ctx, zmq::socket_type::req};
-    socket.connect("tcp://server:9999");
-    const auto send_result = socket.send(
-        zmq::buffer(message, sizeof(message) - 1), zmq::send_flags::none);
-    assert(send_result && *send_result == sizeof(message) - 1);
+    socket.send(zmq::message_t {}, zmq::send_flags::sndmore);
+    const auto sent = Clock::now().time_since_epoch().count();
+    socket.send(zmq::buffer(&sent, sizeof(sent)), zmq::send_flags::sndmore);
     zmq::message_t msg;
-    const auto recv_result = socket.recv(msg, zmq::recv_flags::none);
-    assert(recv_result && *recv_result == sizeof(message) - 1);
-    std::cerr << "Received: " << msg << "\n";
+    for (auto part = 0; part < options.batch; ++part) {
+        // With pooled buffers the payload is written directly into a buffer
+        // that libzmq takes over. Otherwise it's written to a scratch buffer
+        // that message_t copies into a freshly allocated one.
+        if (pool) {
+            msg = pool->make_message(options.size, fill_payload);
+        } else {
+            fill_payload(scratch.data(), options.size);
+            msg = zmq::message_t {scratch.data(), options.size};
+        }
+        const auto flags = part + 1 < options.batch ? zmq::send_flags::sndmore : zmq::send_flags::none;
+        socket.send(msg, flags);
+    }
+}
+
+// Returns false if no reply arrived in time, or if it wasn't the echo of a
+// request. A reply is only waited for so long once the benchmark has ended.
+// The parts of a reply are delivered together, so a missing part means a
+// broken reply rather than a slow one.
+bool receive_reply(
+    zmq::socket_t& socket, const ClientOptions& options, const std::atomic<bool>& stopping,
+    ConnectionResult& result)
+{
+    zmq::message_t msg;
+    auto deadline = Clock::time_point::max();
+    while (!socket.recv(msg, zmq::recv_flags::none)) {
+        const auto now = Clock::now();
+        if (deadline == Clock::time_point::max() && stopping.load(std::memory_order_relaxed)) {
+            deadline = now + std::max<Clock::duration>(DRAIN_TIMEOUT, 2 * result.slowest);
+        }
+        if (now >= deadline) {
+            std::cerr << "Timed out waiting for a reply\n";
+            return false;
+        }
+    }
+    Clock::rep sent;
+    if (msg.size() != 0 || !msg.more() ||
+        !socket.recv(msg, zmq::recv_flags::none) || msg.size() != sizeof(sent) || !msg.more()) {
+        std::cerr << "Malformed reply\n";
+        return false;
+    }
+    std::memcpy(&sent, msg.data(), sizeof(sent));
+    for (auto part = 0; part < options.batch; ++part) {
+        if (!socket.recv(msg, zmq::recv_flags::none) || msg.size() != options.size ||
+            msg.more() != (part + 1 < options.batch)) {
+            std::cerr << "Malformed reply\n";
+            return false;
+        }
+    }
+    const auto latency = Clock::now().time_since_epoch().count() - sent;
+    result.latencies.push_back(latency);
+    result.slowest = std::max(result.slowest, Clock::duration {latency});
+    if (options.duration == 0) {
+        std::cerr << "Received: " << msg << "\n";
+    }
+    result.n_messages += options.batch;
+    return true;
+}
+
+// Keep up to depth requests in flight on one DEALER socket until told to
+// stop, then collect the replies still on their way. A single request waits
+// for its reply for as long as it takes, e.g. for the server to come up.
+void run_connection(
+    zmq::context_t& ctx, const ClientOptions& options, BufferPool* pool,
+    const std::atomic<bool>& stopping, ConnectionResult& result)
+{
+    zmq::socket_t socket {ctx, zmq::socket_type::dealer};
+    if (options.duration > 0) {
+        socket.setsockopt(ZMQ_RCVTIMEO, POLL_INTERVAL_MS);
+    }
+    socket.setsockopt(ZMQ_LINGER, 0);
+    socket.connect(options.endpoint);
+
+    std::vector<char> scratch(options.size);
+    auto in_flight = 0;
+    do {
+        while (in_flight < options.depth) {
+            send_request(socket, options, pool, scratch);
+            ++in_flight;
+        }
+        if (!receive_reply(socket, options, stopping, result)) {
+            return;
+        }
+        --in_flight;
+    } while (!stopping.load(std::memory_order_relaxed));
+    while (in_flight > 0) {
+        if (!receive_reply(socket, options, stopping, result)) {
+            return;
+        }
+        --in_flight;
+    }
+    result.completed = true;
+}
+
+int usage(const char* program)
+{
+    std::cerr << "Usage: " << program
+              << " [-e endpoint] [-c connections] [-p depth] [-s size]"
+              << " [-b batch] [-z] [-d seconds] [-w workers] [-i io_threads]\n";
+    return 1;
+}
+
+double percentile(const std::vector<std::int64_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    const auto index = std::min(
+        sorted.size() - 1, static_cast<std::size_t>(p / 100 * sorted.size()));
+    const std::chrono::duration<double, std::micro> latency {Clock::duration {sorted[index]}};
+    return latency.count();
+}
+
+int main(int argc, char* argv[])
+{
+    ClientOptions options;
+    BrokerOptions broker_options;
+    broker_options.workers = std::max(1u, std::thread::hardware_concurrency());
+    auto io_threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:c:p:s:b:zd:w:i:")) != -1) {
+        switch (opt) {
+        case 'e':
+            options.endpoint = optarg;
+            break;
+        case 'c':
+            options.connections = std::max(1, std::atoi(optarg));
+            break;
+        case 'p':
+            options.depth = std::max(1, std::atoi(optarg));
+            break;
+        case 's':
+            options.size = std::atoi(optarg);
+            break;
+        case 'b':
+            options.batch = std::max(1, std::atoi(optarg));
+            break;
+        case 'z':
+            options.pooled = true;
+            break;
+        case 'd':
+            options.duration = std::atoi(optarg);
+            break;
+        case 'w':
+            broker_options.workers = std::atoi(optarg);
+            break;
+        case 'i':
+            io_threads = std::atoi(optarg);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    // The workers only matter for an embedded broker, but a broker without
+    // them would never answer, and a context without I/O threads can't use
+    // tcp://.
+    if (broker_options.workers < 1 || io_threads < 1) {
+        return usage(argv[0]);
+    }
+    // Without a duration, send a single request like the client always did.
+    if (options.duration == 0) {
+        options.connections = options.depth = options.batch = 1;
+    }
+
+    // The pools are declared before the context, because libzmq may still
+    // return buffers to them until the context is terminated. Each
+    // connection has its own pool, so that they don't contend for the lock.
+    // Payloads small enough to be stored inline are copied anyway, so the
+    // pools are only created when they will be used.
+    const auto use_pools = options.pooled && options.size > BufferPool::MAX_INLINE_SIZE;
+    std::deque<BufferPool> pools;
+    for (auto i = 0; use_pools && i < options.connections; ++i) {
+        pools.emplace_back(options.size, static_cast<std::size_t>(options.depth * options.batch));
+    }
+    zmq::context_t ctx {io_threads};
+
+    // An inproc:// endpoint is only reachable from the same context, so the
+    // server is embedded in the client.
+    std::unique_ptr<Broker> broker;
+    if (options.endpoint.rfind("inproc://", 0) == 0) {
+        broker_options.endpoint = options.endpoint;
+        broker = std::make_unique<Broker>(ctx, broker_options);
+    }
+
+    std::atomic<bool> stopping {options.duration == 0};
+    std::vector<ConnectionResult> results(options.connections);
+    std::vector<std::thread> threads;
+    const auto allocations_before = allocation_count();
+    const auto start = Clock::now();
+    for (auto i = 0; i < options.connections; ++i) {
+        threads.emplace_back(
+            run_connection, std::ref(ctx), std::cref(options), use_pools ? &pools[i] : nullptr,
+            std::cref(stopping), std::ref(results[i]));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds {options.duration});
+    stopping = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const std::chrono::duration<double> elapsed {Clock::now() - start};
+    const auto allocations = allocation_count() - allocations_before;
+    if (broker) {
+        broker->stop();
+    }
+
+    if (options.duration == 0) {
+        return results.front().completed ? 0 : 1;
+    }
+
+    // A connection that ended early stopped counting, so the figures would be
+    // off.
+    const auto n_failed = std::count_if(
+        results.begin(), results.end(), [](const auto& result) { return !result.completed; });
+    if (n_failed > 0) {
+        std::cerr << n_failed << " of " << options.connections << " connections failed\n";
+        return 1;
+    }
+
+    auto n_messages = std::uint64_t {};
+    std::vector<std::int64_t> latencies;
+    for (auto& result : results) {
+        n_messages += result.n_messages;
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << options.endpoint << ": " << options.connections << " connections, pipeline depth "
+              << options.depth << ", " << options.size << " byte messages in batches of "
+              << options.batch << (options.pooled ? ", pooled buffers\n" : "\n")
+              << n_messages << " messages in " << elapsed.count() << " s: "
+              << n_messages / elapsed.count() << " messages/s, "
+              << n_messages * options.size / elapsed.count() / 1e6 << " MB/s, "
+              << static_cast<double>(allocations) / std::max<std::uint64_t>(n_messages, 1)
+              << " allocations/message\n"
+              << "Round trip latency (us): p50 " << percentile(latencies, 50)
+              << ", p90 " << percentile(latencies, 90)
+              << ", p99 " << percentile(latencies, 99)
+              << ", p99.9 " << percentile(latencies, 99.9)
+              << ", max " << percentile(latencies, 100) << "\n";
     return 0;
 }
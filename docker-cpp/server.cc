@@ -1,16 +1,77 @@
+#include "broker.hh"
+
 #include <zmq.hpp>
 
-#include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <unistd.h>
+
+namespace {
+
+int usage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [-e endpoint] [-w workers] [-i io_threads] [-h hwm]\n";
+    return 1;
+}
+
+}
 
-int main()
+int main(int argc, char* argv[])
 {
-    zmq::context_t ctx;
-    zmq::socket_t socket {ctx, zmq::socket_type::rep};
-    socket.bind("tcp://*:9999");
-    zmq::message_t msg;
-    const auto recv_result = socket.recv(msg, zmq::recv_flags::none);
-    assert(recv_result);
-    const auto send_result = socket.send(msg, zmq::send_flags::none);
-    assert(send_result && *recv_result == *send_result);
+    BrokerOptions options;
+    options.workers = std::max(1u, std::thread::hardware_concurrency());
+    auto io_threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:w:i:h:")) != -1) {
+        switch (opt) {
+        case 'e':
+            options.endpoint = optarg;
+            break;
+        case 'w':
+            options.workers = std::atoi(optarg);
+            break;
+        case 'i':
+            io_threads = std::atoi(optarg);
+            break;
+        case 'h':
+            options.hwm = std::atoi(optarg);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    // Without workers the requests would be accepted but never answered, and
+    // without I/O threads nothing goes over tcp://. A high water mark of zero
+    // means no limit.
+    if (options.workers < 1 || io_threads < 1 || options.hwm < 0) {
+        return usage(argv[0]);
+    }
+
+    // Block the signals before any threads are started, so that all the
+    // threads, including the ones started by libzmq, inherit the mask and the
+    // signals are only ever received by sigwait() below.
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
+
+    zmq::context_t ctx {io_threads};
+    Broker broker {ctx, options};
+    const auto start = std::chrono::steady_clock::now();
+
+    int signum;
+    sigwait(&sigset, &signum);
+
+    const auto n_messages = broker.stop();
+    const std::chrono::duration<double> elapsed {std::chrono::steady_clock::now() - start};
+    std::cerr << "Served " << n_messages << " messages in " << elapsed.count()
+              << " s, exiting via " << strsignal(signum) << "\n";
     return 0;
 }
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "coro.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+#include "server.h"
+
+namespace coro {
+
+namespace {
+
+/* How many ready file descriptors one wakeup handles at most. */
+constexpr int MAX_EVENTS = 64;
+
+}
+
+FramePool::~FramePool()
+{
+    while (free_blocks) {
+        const auto block = free_blocks;
+        free_blocks = block->next;
+        ::operator delete(block);
+    }
+}
+
+void* FramePool::allocate(std::size_t size)
+{
+    ++n_allocations;
+    auto block = free_blocks;
+    if (block && block->capacity >= size) {
+        free_blocks = block->next;
+    } else {
+        /* Either the pool is empty, or the frames in it are too small. All
+         * frames in the free list have the same capacity, so we just allocate
+         * a new one from the heap. */
+        block = static_cast<Block*>(::operator new(sizeof(Block) + size));
+        block->pool = this;
+        block->capacity = size;
+        ++n_heap_allocations;
+    }
+    block->next = nullptr;
+    return block + 1;
+}
+
+void FramePool::deallocate(void* frame) noexcept
+{
+    const auto block = static_cast<Block*>(frame) - 1;
+    const auto pool = block->pool;
+    if (pool->free_blocks && pool->free_blocks->capacity != block->capacity) {
+        /* Keep the free list uniform. In practice all the frames come from
+         * the same coroutine and this doesn't happen. */
+        ::operator delete(block);
+        return;
+    }
+    block->next = pool->free_blocks;
+    pool->free_blocks = block;
+}
+
+EventLoop::WaitAwaiter::WaitAwaiter(EventLoop& loop, int fd, short events, Duration timeout) :
+    loop {loop},
+    fd {fd},
+    events {events},
+    deadline {timeout < Duration::zero() ? Clock::time_point::max() : Clock::now() + timeout}
+{
+}
+
+void EventLoop::WaitAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    this->handle = handle;
+    /* The file descriptor is registered only for the duration of the wait.
+     * With poll that's just updating an array, but epoll needs a system call
+     * to add and another to remove it. */
+    if (fd >= 0 && poller_add(loop.loop_poller, fd, events, this)) {
+        handle_error("poller_add");
+    }
+    index = loop.waiters.size();
+    loop.waiters.push_back(this);
+}
+
+EventLoop::EventLoop(metrics& metrics, poller_backend backend) :
+    loop_metrics {metrics},
+    loop_poller {create_poller(backend, MAX_EVENTS)},
+    events(MAX_EVENTS)
+{
+    if (!loop_poller) {
+        handle_error("create_poller");
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    destroy_coroutines();
+    destroy_poller(loop_poller);
+}
+
+EventLoop::WaitAwaiter EventLoop::readable(int fd, Duration timeout)
+{
+    return WaitAwaiter {*this, fd, POLLIN, timeout};
+}
+
+EventLoop::WaitAwaiter EventLoop::writable(int fd, Duration timeout)
+{
+    return WaitAwaiter {*this, fd, POLLOUT, timeout};
+}
+
+EventLoop::WaitAwaiter EventLoop::sleep_for(Duration timeout)
+{
+    /* A waiter without a file descriptor is not given to the poller, so it
+     * can only time out. */
+    return WaitAwaiter {*this, -1, 0, timeout};
+}
+
+void EventLoop::schedule(std::coroutine_handle<> handle)
+{
+    ready.push_back(handle);
+}
+
+int EventLoop::poll_timeout(Clock::time_point now) const
+{
+    if (!ready.empty()) {
+        return 0;
+    }
+    auto deadline = Clock::time_point::max();
+    for (const auto waiter : waiters) {
+        deadline = std::min(deadline, waiter->deadline);
+    }
+    if (deadline == Clock::time_point::max()) {
+        return -1;
+    }
+    if (deadline <= now) {
+        return 0;
+    }
+    /* Round up so that we don't wake up just before the deadline. */
+    const auto timeout = std::chrono::ceil<std::chrono::milliseconds>(deadline - now);
+    return static_cast<int>(std::min<std::chrono::milliseconds::rep>(timeout.count(), 1 << 30));
+}
+
+void EventLoop::wake(WaitAwaiter& waiter, Readiness result)
+{
+    if (waiter.fd >= 0 && poller_remove(loop_poller, waiter.fd)) {
+        handle_error("poller_remove");
+    }
+    waiters.back()->index = waiter.index;
+    waiters[waiter.index] = waiters.back();
+    waiters.pop_back();
+    waiter.result = result;
+    ready.push_back(waiter.handle);
+}
+
+void EventLoop::resume_ready()
+{
+    /* Resume the coroutines that are ready. They may schedule more coroutines,
+     * which will run on the next round. */
+    resuming.swap(ready);
+    for (const auto handle : resuming) {
+        const auto handler_time = metrics_now();
+        handle.resume();
+        metrics_record_handler(&loop_metrics, handler_time);
+    }
+    resuming.clear();
+}
+
+void EventLoop::run()
+{
+    int n_events;
+    std::uint64_t wakeup_time;
+
+    resume_ready();
+    while (!stopped) {
+        if ((n_events = poller_wait(loop_poller, events.data(), events.size(),
+                                    poll_timeout(Clock::now()))) < 0) {
+            handle_error("poller_wait");
+        }
+        wakeup_time = metrics_now();
+
+        /* Move every waiter whose event happened (or whose deadline passed)
+         * from the polling list to the ready list. The coroutines are resumed
+         * only after the scan, because they will modify the polling list
+         * when they co_await again. */
+        for (auto i = 0; i < n_events; ++i) {
+            const auto waiter = static_cast<WaitAwaiter*>(events[i].data);
+            const auto revents = events[i].revents;
+            if (revents & POLLERR) {
+                wake(*waiter, Readiness::ERROR);
+            } else if (revents & POLLHUP) {
+                wake(*waiter, Readiness::HANGUP);
+            } else {
+                wake(*waiter, Readiness::READY);
+            }
+        }
+        const auto now = Clock::now();
+        for (std::size_t i = 0; i < waiters.size();) {
+            if (waiters[i]->deadline <= now) {
+                /* wake() moves the last waiter to this position. */
+                wake(*waiters[i], Readiness::TIMEOUT);
+            } else {
+                ++i;
+            }
+        }
+
+        resume_ready();
+        metrics_record_wakeup(&loop_metrics, n_events, wakeup_time);
+    }
+
+    destroy_coroutines();
+}
+
+void EventLoop::destroy_coroutines()
+{
+    /* Destroying a suspended coroutine runs the destructors of its local
+     * variables, so the handlers get to close their sockets. The waiters
+     * live in the frames being destroyed, so forget them first. */
+    for (const auto waiter : waiters) {
+        if (waiter->fd >= 0) {
+            poller_remove(loop_poller, waiter->fd);
+        }
+    }
+    waiters.clear();
+    while (coroutines) {
+        std::coroutine_handle<Task::promise_type>::from_promise(*coroutines).destroy();
+    }
+    ready.clear();
+}
+
+Semaphore::AcquireAwaiter::~AcquireAwaiter()
+{
+    /* If the coroutine is destroyed while waiting, take it out of the
+     * queue. */
+    AcquireAwaiter* prev = nullptr;
+    for (auto waiter = semaphore.first_waiter; waiter; waiter = waiter->next) {
+        if (waiter == this) {
+            (prev ? prev->next : semaphore.first_waiter) = next;
+            if (semaphore.last_waiter == this) {
+                semaphore.last_waiter = prev;
+            }
+            break;
+        }
+        prev = waiter;
+    }
+}
+
+bool Semaphore::AcquireAwaiter::await_ready() noexcept
+{
+    if (semaphore.count > 0) {
+        --semaphore.count;
+        return true;
+    }
+    return false;
+}
+
+void Semaphore::AcquireAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    this->handle = handle;
+    if (semaphore.last_waiter) {
+        semaphore.last_waiter->next = this;
+    } else {
+        semaphore.first_waiter = this;
+    }
+    semaphore.last_waiter = this;
+}
+
+void Semaphore::release()
+{
+    /* If somebody is waiting, the unit is handed directly to them. */
+    if (const auto waiter = first_waiter) {
+        first_waiter = waiter->next;
+        if (!first_waiter) {
+            last_waiter = nullptr;
+        }
+        loop.schedule(waiter->handle);
+    } else {
+        ++count;
+    }
+}
+
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A tiny C++20 coroutine layer on top of poll(). This is the same idea as the
+ * hand-written state machine in lib.c, except that the compiler writes the
+ * state machine for us: a handler co_awaits a socket becoming readable or
+ * writable, and the event loop resumes it when poll() says so.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <vector>
+
+#include <poll.h>
+
+#include "metrics.h"
+#include "poller.h"
+
+namespace coro {
+
+class EventLoop;
+
+/* Coroutine frames of the connection handlers all have the same size, so
+ * instead of going through the global allocator for each connection the event
+ * loop keeps the frames of finished coroutines in a free list and reuses them.
+ * Once the server has seen its peak number of concurrent connections, no more
+ * heap allocations happen. */
+class FramePool {
+public:
+    FramePool() = default;
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+    ~FramePool();
+
+    void* allocate(std::size_t size);
+    static void deallocate(void* frame) noexcept;
+
+    std::size_t heap_allocations() const noexcept { return n_heap_allocations; }
+    std::size_t allocations() const noexcept { return n_allocations; }
+
+private:
+    struct alignas(alignof(std::max_align_t)) Block {
+        FramePool* pool;
+        std::size_t capacity;
+        Block* next;
+    };
+
+    Block* free_blocks {nullptr};
+    std::size_t n_heap_allocations {0};
+    std::size_t n_allocations {0};
+};
+
+/* The result of waiting for a file descriptor. */
+enum class Readiness {
+    READY,
+    HANGUP,
+    ERROR,
+    TIMEOUT,
+};
+
+/* The return type of a connection handler. The coroutine starts eagerly and
+ * nobody waits for it: it runs until its first co_await and the event loop
+ * takes it from there. The first parameter of the coroutine must be the event
+ * loop, because that's where the frame is allocated from. */
+class Task {
+public:
+    struct promise_type {
+        template<typename... Args>
+        promise_type(EventLoop& loop, Args&...);
+        ~promise_type();
+
+        template<typename... Args>
+        static void* operator new(std::size_t size, EventLoop& loop, Args&...);
+        static void operator delete(void* frame, std::size_t) noexcept
+        {
+            FramePool::deallocate(frame);
+        }
+
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+
+        EventLoop& loop;
+        promise_type* prev {nullptr};
+        promise_type* next {nullptr};
+    };
+};
+
+class EventLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Duration = Clock::duration;
+
+    class WaitAwaiter {
+    public:
+        WaitAwaiter(EventLoop& loop, int fd, short events, Duration timeout);
+        WaitAwaiter(const WaitAwaiter&) = delete;
+        WaitAwaiter& operator=(const WaitAwaiter&) = delete;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        Readiness await_resume() const noexcept { return result; }
+
+    private:
+        EventLoop& loop;
+        int fd;
+        short events;
+        Clock::time_point deadline;
+        std::coroutine_handle<> handle;
+        std::size_t index {0};
+        Readiness result {Readiness::TIMEOUT};
+
+        friend class EventLoop;
+    };
+
+    explicit EventLoop(metrics& metrics, poller_backend backend = POLLER_POLL);
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    ~EventLoop();
+
+    /* Awaitables. A negative timeout means waiting forever. Only one
+     * coroutine at a time may wait for a file descriptor.
+     *
+     * Assign the result of co_await to a variable instead of using it directly
+     * in a condition. GCC 12 keeps the awaiter of a co_await nested in a
+     * comparison on the stack instead of the coroutine frame, and the event
+     * loop would end up resuming a dangling handle. */
+    WaitAwaiter readable(int fd, Duration timeout = Duration {-1});
+    WaitAwaiter writable(int fd, Duration timeout = Duration {-1});
+    WaitAwaiter sleep_for(Duration timeout);
+
+    /* Resume a coroutine on the next iteration of the loop. */
+    void schedule(std::coroutine_handle<> handle);
+
+    /* Run until stop() is called, and then destroy all coroutines that are
+     * still suspended. */
+    void run();
+    void stop() noexcept { stopped = true; }
+
+    FramePool& frame_pool() noexcept { return pool; }
+
+private:
+    int poll_timeout(Clock::time_point now) const;
+    void wake(WaitAwaiter& waiter, Readiness result);
+    void resume_ready();
+    void destroy_coroutines();
+
+    metrics& loop_metrics;
+    FramePool pool;
+    poller* loop_poller;
+    std::vector<poller_event> events;
+    std::vector<WaitAwaiter*> waiters;
+    std::vector<std::coroutine_handle<>> ready;
+    std::vector<std::coroutine_handle<>> resuming;
+    Task::promise_type* coroutines {nullptr};
+    bool stopped {false};
+
+    friend struct Task::promise_type;
+};
+
+/* Counting semaphore for coroutines running in the same event loop. Used to
+ * cap the number of concurrent connections. */
+class Semaphore {
+public:
+    class AcquireAwaiter {
+    public:
+        explicit AcquireAwaiter(Semaphore& semaphore) : semaphore {semaphore} {}
+        AcquireAwaiter(const AcquireAwaiter&) = delete;
+        AcquireAwaiter& operator=(const AcquireAwaiter&) = delete;
+        ~AcquireAwaiter();
+        bool await_ready() noexcept;
+        void await_suspend(std::coroutine_handle<> handle) noexcept;
+        void await_resume() const noexcept {}
+
+    private:
+        Semaphore& semaphore;
+        std::coroutine_handle<> handle;
+        AcquireAwaiter* next {nullptr};
+
+        friend class Semaphore;
+    };
+
+    Semaphore(EventLoop& loop, int count) : loop {loop}, count {count} {}
+
+    AcquireAwaiter acquire() noexcept { return AcquireAwaiter {*this}; }
+    void release();
+
+private:
+    EventLoop& loop;
+    int count;
+    AcquireAwaiter* first_waiter {nullptr};
+    AcquireAwaiter* last_waiter {nullptr};
+};
+
+template<typename... Args>
+Task::promise_type::promise_type(EventLoop& loop, Args&...) :
+    loop {loop},
+    next {loop.coroutines}
+{
+    if (next) {
+        next->prev = this;
+    }
+    loop.coroutines = this;
+}
+
+inline Task::promise_type::~promise_type()
+{
+    if (prev) {
+        prev->next = next;
+    } else {
+        loop.coroutines = next;
+    }
+    if (next) {
+        next->prev = prev;
+    }
+}
+
+template<typename... Args>
+void* Task::promise_type::operator new(std::size_t size, EventLoop& loop, Args&...)
+{
+    return loop.frame_pool().allocate(size);
+}
+
+}
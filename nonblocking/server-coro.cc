@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The same echo server as server.c, but the connections are handled by C++20
+ * coroutines instead of the hand-written state machine in
+ * ../server-core/connection.c. Takes the same options as server.c.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "coro.hh"
+#include "frame.h"
+#include "metrics.h"
+#include "server.h"
+
+namespace {
+
+using namespace std::chrono_literals;
+
+using coro::EventLoop;
+using coro::Readiness;
+using coro::Semaphore;
+using coro::Task;
+
+constexpr int MAX_CONNECTIONS = 10;
+constexpr auto CONNECTION_TIMEOUT = 30s;
+
+/* Closes the socket and frees the connection slot when the handler returns,
+ * or when the event loop destroys it during shutdown. */
+class Connection {
+public:
+    Connection(int fd, Semaphore& slots, metrics& metrics) :
+        fd {fd},
+        slots {slots},
+        connection_metrics {metrics}
+    {
+        metrics_record_accept(&connection_metrics);
+    }
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+    ~Connection()
+    {
+        close(fd);
+        slots.release();
+        metrics_record_close(&connection_metrics);
+    }
+
+private:
+    int fd;
+    Semaphore& slots;
+    metrics& connection_metrics;
+};
+
+Task handle_connection(EventLoop& loop, Semaphore& slots, metrics& metrics, int socket_fd)
+{
+    const Connection connection {socket_fd, slots, metrics};
+    /* The buffer is part of the coroutine frame, so it's allocated from the
+     * frame pool of the event loop together with everything else. */
+    char buf[FRAME_MAX];
+    const char* buf_end = nullptr;
+    std::size_t bytes = 0;
+    ssize_t result;
+    Readiness readiness;
+
+    /* Compare this to the switch statement in lib.c. Waiting for the socket
+     * to become readable or writable is now just a co_await, and the state of
+     * the connection lives in ordinary local variables. */
+    while (!buf_end) {
+        if (bytes == sizeof(buf)) {
+            co_return;
+        }
+        readiness = co_await loop.readable(socket_fd, CONNECTION_TIMEOUT);
+        if (readiness != Readiness::READY) {
+            co_return;
+        }
+        result = read(socket_fd, buf + bytes, sizeof(buf) - bytes);
+        if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return;
+        } else if (result == 0) {
+            co_return;
+        } else if (result > 0) {
+            metrics_record_bytes_in(&metrics, result);
+            buf_end = static_cast<const char*>(std::memchr(buf + bytes, '\n', result));
+            bytes += result;
+        }
+    }
+
+    result = echo_handler.handle(echo_handler.arg, buf, buf_end - buf + 1, sizeof(buf));
+    if (result < 0) {
+        co_return;
+    }
+    bytes = result;
+
+    for (std::size_t written = 0; written < bytes;) {
+        result = write(socket_fd, buf + written, bytes - written);
+        if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return;
+        } else if (result >= 0) {
+            metrics_record_bytes_out(&metrics, result);
+            written += result;
+            continue;
+        }
+        readiness = co_await loop.writable(socket_fd, CONNECTION_TIMEOUT);
+        if (readiness != Readiness::READY) {
+            co_return;
+        }
+    }
+}
+
+Task accept_connections(
+    EventLoop& loop, Semaphore& slots, metrics& metrics, const server_options& options, int server_fd)
+{
+    int socket_fd;
+    Readiness readiness;
+
+    while (true) {
+        /* Waiting for a free slot before waiting for the server socket is the
+         * same as removing the server socket from the polling list in
+         * server.c. */
+        co_await slots.acquire();
+        readiness = co_await loop.readable(server_fd);
+        if (readiness != Readiness::READY) {
+            handle_error("server failure");
+        }
+        if ((socket_fd = accept_connection(server_fd, &options)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+                slots.release();
+                continue;
+            }
+            handle_error("accept");
+        }
+        handle_connection(loop, slots, metrics, socket_fd);
+    }
+}
+
+Task serve_admin(EventLoop& loop, const metrics& metrics, int admin_fd)
+{
+    Readiness readiness;
+
+    while (true) {
+        readiness = co_await loop.readable(admin_fd);
+        if (readiness != Readiness::READY) {
+            handle_error("admin_fd failure");
+        }
+        serve_metrics(&metrics, admin_fd);
+    }
+}
+
+Task wait_for_signal(EventLoop& loop, const metrics& metrics, int signal_fd, signalfd_siginfo& siginfo)
+{
+    Readiness readiness;
+
+    /* SIGUSR1 dumps the metrics, anything else stops the server. */
+    do {
+        readiness = co_await loop.readable(signal_fd);
+        if (readiness != Readiness::READY) {
+            handle_error("signal_fd failure");
+        }
+        if (read(signal_fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) {
+            handle_error("read siginfo");
+        }
+        if (siginfo.ssi_signo == SIGUSR1) {
+            dump_metrics(&metrics, STDERR_FILENO);
+        }
+    } while (siginfo.ssi_signo == SIGUSR1);
+    loop.stop();
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    sigset_t sigset;
+    signalfd_siginfo siginfo;
+    int server_fd, signal_fd, admin_fd, opt, max_connections = MAX_CONNECTIONS;
+    server_options options;
+    metrics* metrics;
+
+    init_server_options(&options);
+    options.nonblocking = 1;
+    while ((opt = getopt(argc, argv, "c:" SERVER_OPTSTRING)) != -1) {
+        /* With no slots, no connection would ever be served. */
+        if (opt == 'c' ? parse_int_option(optarg, 1, INT_MAX, &max_connections)
+                       : parse_server_option(&options, opt, optarg)) {
+            break;
+        }
+    }
+    if (opt != -1) {
+        fprintf(stderr, "Usage: %s [-c max_connections] " SERVER_USAGE "\n", argv[0]);
+        return 1;
+    }
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGUSR1);
+    sigprocmask(SIG_SETMASK, &sigset, NULL);
+
+    server_fd = create_server_with(&options);
+    signal_fd = signalfd(-1, &sigset, SFD_CLOEXEC);
+    admin_fd = create_admin_server(options.admin_port);
+    if (!(metrics = create_metrics())) {
+        handle_error("create_metrics");
+    }
+
+    {
+        EventLoop loop {*metrics, options.backend};
+        Semaphore slots {loop, max_connections};
+        fprintf(stderr, "Serving port %d with %s\n", options.port, poller_backend_name(options.backend));
+        wait_for_signal(loop, *metrics, signal_fd, siginfo);
+        if (admin_fd >= 0) {
+            serve_admin(loop, *metrics, admin_fd);
+        }
+        accept_connections(loop, slots, *metrics, options, server_fd);
+        loop.run();
+
+        const auto& pool = loop.frame_pool();
+        fprintf(stderr, "Allocated %zu coroutine frames, %zu from the heap\n",
+                pool.allocations(), pool.heap_allocations());
+    }
+
+    fprintf(stderr, "Exiting via %s\n", strsignal(siginfo.ssi_signo));
+    close(signal_fd);
+    if (admin_fd >= 0) {
+        close(admin_fd);
+    }
+    close(server_fd);
+    destroy_metrics(metrics);
+    return 0;
+}
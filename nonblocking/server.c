@@ -20,160 +20,237 @@
  * SOFTWARE.
  */
 
+/*
+ * The echo server with the connections handled by the state machine in
+ * ../server-core/connection.c. Usage: server [-c max_connections] [options],
+ * where the options are the ones in ../server-core/server.h.
+ */
+
 #include <assert.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/signalfd.h>
-#include <sys/socket.h>
 #include <unistd.h>
 
-#include "lib.h"
+#include "connection.h"
+#include "metrics.h"
+#include "poller.h"
+#include "server.h"
 
-static const int SERVER_FD = 0;
-static const int SIGNAL_FD = 1;
-static const int FIRST_CONNECTION = 2;
 static const int MAX_CONNECTIONS = 10;
-static const int POLLFDS = FIRST_CONNECTION + MAX_CONNECTIONS;
 
-int main()
+/* The poller hands back the pointer that was registered with the file
+ * descriptor. The listening socket, the signalfd and the admin socket are
+ * told apart from the connections by these tags. */
+static char SERVER_TAG, SIGNAL_TAG, ADMIN_TAG;
+
+struct slot
+{
+    int fd;
+    struct context* connection;
+};
+
+int main(int argc, char* argv[])
 {
     sigset_t sigset;
     struct signalfd_siginfo siginfo;
-    int server_fd, socket_fd, signal_fd, i, total_connections, connection_completed, flags;
+    int server_fd, socket_fd, signal_fd, admin_fd, i, n_events, opt, running,
+        max_connections = MAX_CONNECTIONS, total_connections, connection_completed;
     short revents, events_out;
-    struct pollfd pollfds[MAX_CONNECTIONS + 2];
-    struct context* connection;
-    struct context* connections[MAX_CONNECTIONS];
+    struct server_options options;
+    struct poller* poller;
+    struct poller_event* events;
+    struct slot* slots;
+    struct slot* slot;
+    struct metrics* metrics;
+    uint64_t wakeup_time, handler_time;
+
+    init_server_options(&options);
+    options.nonblocking = 1;
+    while ((opt = getopt(argc, argv, "c:" SERVER_OPTSTRING)) != -1) {
+        /* The slots are scanned for a free one, so there must be at least
+         * one. The events also have room for the three sockets of the
+         * server. */
+        if (opt == 'c' ? parse_int_option(optarg, 1, INT_MAX - 3, &max_connections)
+                       : parse_server_option(&options, opt, optarg)) {
+            break;
+        }
+    }
+    if (opt != -1) {
+        fprintf(stderr, "Usage: %s [-c max_connections] " SERVER_USAGE "\n", argv[0]);
+        return 1;
+    }
 
     /* Setting up signalfd to read signals is explained in:
      * https://www.jmoisio.eu/en/blog/2020/04/20/handling-signals-correctly-in-a-linux-application/ */
 
     sigemptyset(&sigset);
     sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGUSR1);
     sigprocmask(SIG_SETMASK, &sigset, NULL);
 
-    server_fd = create_server();
-    pollfds[SERVER_FD].fd = server_fd;
-    pollfds[SERVER_FD].events = POLLIN;
+    /* One wakeup can report every connection plus the three sockets of the
+     * server itself. */
+    if (!(poller = create_poller(options.backend, max_connections + 3)) ||
+        !(events = calloc(max_connections + 3, sizeof(struct poller_event))) ||
+        !(slots = calloc(max_connections, sizeof(struct slot)))) {
+        handle_error("create_poller");
+    }
+
+    server_fd = create_server_with(&options);
+    if (poller_add(poller, server_fd, POLLIN, &SERVER_TAG)) {
+        handle_error("poller_add");
+    }
 
-    signal_fd = signalfd(-1, &sigset, 0);
-    pollfds[SIGNAL_FD].fd = signal_fd;
-    pollfds[SIGNAL_FD].events = POLLIN;
+    signal_fd = signalfd(-1, &sigset, SFD_CLOEXEC);
+    if (poller_add(poller, signal_fd, POLLIN, &SIGNAL_TAG)) {
+        handle_error("poller_add");
+    }
 
-    /* Setting up the connection objects. Initially there are no connections so
-     * add dummy entries to the polling list. */
+    /* The metrics are exposed on a separate socket that only accepts local
+     * connections. */
 
-    for (i = FIRST_CONNECTION; i < POLLFDS; ++i) {
-        pollfds[i].fd = -1;
-        pollfds[i].events = 0;
+    if (!(metrics = create_metrics())) {
+        handle_error("create_metrics");
+    }
+    admin_fd = create_admin_server(options.admin_port);
+    if (admin_fd >= 0 && poller_add(poller, admin_fd, POLLIN, &ADMIN_TAG)) {
+        handle_error("poller_add");
     }
-    memset(connections, 0, sizeof(connections));
+
     total_connections = 0;
+    running = 1;
+    fprintf(stderr, "Serving port %d with %s\n", options.port, poller_backend_name(options.backend));
 
-    while (1) {
-        for (i = 0; i < POLLFDS; ++i) {
-            pollfds[i].revents = 0;
-        }
-        if (poll(pollfds, POLLFDS, -1) < 0) {
-            handle_error("poll");
+    while (running) {
+        if ((n_events = poller_wait(poller, events, max_connections + 3, -1)) < 0) {
+            handle_error("poller_wait");
         }
+        wakeup_time = metrics_now();
 
-        /* Handle an incoming connection. */
-        if (pollfds[0].revents & POLLERR) {
-            handle_error("server failure");
-        } else if (pollfds[0].revents & POLLIN) {
-            /* Accept an incoming connection. Immediately set nonblocking mode. */
-            if ((socket_fd = accept(server_fd, NULL, NULL)) < 0) {
-                handle_error("accept");
-            }
-            flags = fcntl(socket_fd, F_GETFD, 0);
-            if (fcntl(socket_fd, F_SETFD, flags | O_NONBLOCK)) {
-                handle_error("fcntl");
-            }
-            /* Create context for the connection. Setup pollfds for the socket
-             * just created. */
-            for (i = 0; i < MAX_CONNECTIONS; ++i) {
-                if (!connections[i]) {
-                    connection = create_connection(socket_fd, &events_out);
-                    if (!connection) {
-                        handle_error("create_connection");
+        for (i = 0; i < n_events; ++i) {
+            revents = events[i].revents;
+
+            /* Handle an incoming connection. The socket is set up according
+             * to the options by accept_connection(). */
+            if (events[i].data == &SERVER_TAG) {
+                if (revents & POLLERR) {
+                    handle_error("server failure");
+                }
+                if ((socket_fd = accept_connection(server_fd, &options)) < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+                        continue;
                     }
-                    connections[i] = connection;
-                    pollfds[FIRST_CONNECTION + i].fd = socket_fd;
-                    pollfds[FIRST_CONNECTION + i].events = events_out;
-                    ++total_connections;
-                    assert(total_connections <= MAX_CONNECTIONS);
-                    break;
+                    handle_error("accept");
+                }
+                metrics_record_accept(metrics);
+                /* Create context for the connection, and start polling the
+                 * socket just created. */
+                for (slot = slots; slot->connection; ++slot);
+                if (!(slot->connection = create_connection(socket_fd, &echo_handler, metrics, &events_out))) {
+                    handle_error("create_connection");
+                }
+                slot->fd = socket_fd;
+                if (poller_add(poller, socket_fd, events_out, slot)) {
+                    handle_error("poller_add");
+                }
+                ++total_connections;
+                assert(total_connections <= max_connections);
+                /* If we reached the maximum number of concurrent connections,
+                 * stop polling the server socket. The new clients wait in the
+                 * backlog meanwhile. */
+                if (total_connections == max_connections &&
+                    poller_modify(poller, server_fd, 0, &SERVER_TAG)) {
+                    handle_error("poller_modify");
+                }
+                continue;
+            }
+
+            /* Check if a signal was received. If it was, read the signal
+             * info. SIGUSR1 dumps the metrics, SIGTERM breaks away from the
+             * event loop. */
+            if (events[i].data == &SIGNAL_TAG) {
+                if (revents & POLLERR) {
+                    handle_error("signal_fd failure");
                 }
+                if (read(signal_fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) {
+                    handle_error("read siginfo");
+                }
+                if (siginfo.ssi_signo == SIGUSR1) {
+                    dump_metrics(metrics, STDERR_FILENO);
+                } else {
+                    running = 0;
+                }
+                continue;
             }
-            /* If we reached the maximum number of concurrent connections,
-             * remove the server socket from the polling list. The negation is a
-             * neat trick explained in the poll() man page:
-             * https://man7.org/linux/man-pages/man2/poll.2.html */
-            if (total_connections == MAX_CONNECTIONS) {
-                assert(pollfds[SERVER_FD].fd > 0);
-                pollfds[SERVER_FD].fd = -pollfds[SERVER_FD].fd;
+
+            /* Serve the metrics to whoever connected to the admin socket. */
+            if (events[i].data == &ADMIN_TAG) {
+                if (revents & POLLERR) {
+                    handle_error("admin_fd failure");
+                }
+                serve_metrics(metrics, admin_fd);
+                continue;
             }
-        }
 
-        /* Check if a signal was received. If it was, read the signal info and
-         * break away from the event loop. */
-        if (pollfds[1].revents & POLLERR) {
-            handle_error("signal_fd failure");
-        } else if (pollfds[1].revents & POLLIN) {
-            if (read(signal_fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) {
-                handle_error("read siginfo");
+            /* Handle a connection. We call handle_connection() with the
+             * context object, and in the next round listen to the events
+             * returned by the handler -- a sort of coroutine! A failing
+             * connection is just dropped. */
+            slot = events[i].data;
+            events_out = 0;
+            connection_completed = 0;
+            handler_time = metrics_now();
+            if ((revents & POLLERR) ||
+                handle_connection(slot->connection, revents, &events_out, &connection_completed)) {
+                connection_completed = 1;
             }
-            break;
-        }
+            metrics_record_handler(metrics, handler_time);
 
-        /* Handle connections. */
-        for (i = 0; i < MAX_CONNECTIONS; ++i) {
-            revents = pollfds[i + FIRST_CONNECTION].revents;
-            if (revents & POLLERR) {
-                handle_error("socket failure");
-            } else if (revents) {
-                connection = connections[i];
-                events_out = 0;
-                connection_completed = 0;
-                /* For each connection that has events, we call
-                 * handle_connection() with the context object, and in the next
-                 * round listen to the events returned by the handler -- a sort
-                 * of coroutine! */
-                if (handle_connection(connection, revents, &events_out, &connection_completed)) {
-                    handle_error("handle_connection");
+            /* If a connection was completed, free the context object. If the
+             * number of connections was capped, the server is now free to
+             * serve more clients, so start polling the server socket again. */
+            if (connection_completed) {
+                if (poller_remove(poller, slot->fd)) {
+                    handle_error("poller_remove");
                 }
-                pollfds[i + FIRST_CONNECTION].events = events_out;
-                /* If a connection was completed, free the context object. If
-                 * the number of connections was capped, the server is now free
-                 * to serve more clients, so add the server socket back to the
-                 * polling list. */
-                if (connection_completed) {
-                    destroy_connection(connection);
-                    connections[i] = NULL;
-                    pollfds[i + FIRST_CONNECTION].fd = -1;
-                    if (total_connections == MAX_CONNECTIONS) {
-                        assert(pollfds[SERVER_FD].fd < 0);
-                        pollfds[SERVER_FD].fd = -pollfds[SERVER_FD].fd;
-                    }
-                    --total_connections;
-                    assert(total_connections >= 0);
+                metrics_record_close(metrics);
+                destroy_connection(slot->connection);
+                slot->connection = NULL;
+                if (total_connections == max_connections &&
+                    poller_modify(poller, server_fd, POLLIN, &SERVER_TAG)) {
+                    handle_error("poller_modify");
                 }
+                --total_connections;
+                assert(total_connections >= 0);
+            } else if (poller_modify(poller, slot->fd, events_out, slot)) {
+                handle_error("poller_modify");
             }
         }
+
+        metrics_record_wakeup(metrics, n_events, wakeup_time);
     }
 
     /* We're done! Just clean up and exit. */
     fprintf(stderr, "Exiting via %s\n", strsignal(siginfo.ssi_signo));
+    destroy_poller(poller);
     close(signal_fd);
+    if (admin_fd >= 0) {
+        close(admin_fd);
+    }
     close(server_fd);
-    for (i = 0; i < MAX_CONNECTIONS; ++i) {
-        if (connections[i]) {
-            destroy_connection(connections[i]);
+    for (i = 0; i < max_connections; ++i) {
+        if (slots[i].connection) {
+            destroy_connection(slots[i].connection);
         }
     }
+    free(slots);
+    free(events);
+    destroy_metrics(metrics);
     return 0;
 }
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Build every server variant and run the load generator against each of them
+# in turn, so that they can be compared on the same machine. The arguments are
+# passed to the load generator, e.g. bench.sh -c 16 -d 10
+#
+# The servers listen on $PORT and serve their metrics on $ADMIN_PORT, 9999 and
+# 9998 unless set, so that a second run can go side by side with its own ports.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s -C server-core
+make -s -C nonblocking
+make -s -C signal-handling
+
+PORT=${PORT:-9999}
+ADMIN_PORT=${ADMIN_PORT:-9998}
+LOADGEN_ARGS="-p $PORT $*"
+
+run() {
+    "$@" 2>/dev/null &
+    pid=$!
+    sleep 0.5
+    printf '%-64s %s\n' "$*" "$(server-core/loadgen $LOADGEN_ARGS)"
+    kill $pid
+    wait $pid || true
+}
+
+run signal-handling/server-bad -p $PORT
+run signal-handling/server-good -p $PORT
+run signal-handling/server-best -p $PORT
+run signal-handling/server-best -p $PORT -w 4
+run nonblocking/server -p $PORT -a $ADMIN_PORT -e poll
+run nonblocking/server -p $PORT -a $ADMIN_PORT -e epoll
+run nonblocking/server -p $PORT -a $ADMIN_PORT -e epoll -c 64 -b 128 -n
+run nonblocking/server-coro -p $PORT -a $ADMIN_PORT -e poll
+run nonblocking/server-coro -p $PORT -a $ADMIN_PORT -e epoll
+run nonblocking/server-coro -p $PORT -a $ADMIN_PORT -e epoll -c 64 -b 128 -n
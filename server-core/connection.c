@@ -20,16 +20,16 @@
  * SOFTWARE.
  */
 
-#include <arpa/inet.h>
 #include <assert.h>
-#include <fcntl.h>
+#include <errno.h>
 #include <poll.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
 #include <unistd.h>
 
+#include "connection.h"
+#include "metrics.h"
+
 enum state
 {
     READING,
@@ -41,71 +41,35 @@ struct context
 {
     int fd;
     enum state state;
-    char buf[65536];
+    char buf[FRAME_MAX];
     size_t bytes;
-    char* buf_end;
+    size_t response_len;
+    const struct frame_handler* handler;
+    struct metrics* metrics;
 };
 
-const int REUSEADDR = 1;
-const uint16_t PORT = 9999;
-const int SOCKET_BACKLOG = 10;
-
-void handle_error(const char* s)
-{
-    perror(s);
-    exit(1);
-}
-
-struct context* create_connection(int socket_fd, short* events_out)
+struct context* create_connection(int socket_fd, const struct frame_handler* handler,
+                                  struct metrics* metrics, short* events_out)
 {
+    /* The buffer is not cleared, only the bytes that have been read are ever
+     * looked at. */
     struct context* ctx = (struct context*)malloc(sizeof(struct context));
     if (ctx) {
         ctx->fd = socket_fd;
         ctx->state = READING;
-        memset(ctx->buf, 0, sizeof(ctx->buf));
         ctx->bytes = 0;
-        ctx->buf_end = NULL;
+        ctx->response_len = 0;
+        ctx->handler = handler;
+        ctx->metrics = metrics;
         *events_out = POLLIN;
     }
     return ctx;
 }
 
-int create_server()
-{
-    int server_fd, flags;
-    struct sockaddr_in addr;
-
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        handle_error("socket");
-    }
-
-    flags = fcntl(server_fd, F_GETFD, 0);
-    if (fcntl(server_fd, F_SETFD, flags | O_NONBLOCK)) {
-        handle_error("fcntl");
-    }
-
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &REUSEADDR,
-                   sizeof(REUSEADDR)) < 0) {
-        handle_error("setsockopt");
-    }
-
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        handle_error("bind");
-    }
-
-    if (listen(server_fd, SOCKET_BACKLOG) < 0) {
-        handle_error("listen");
-    }
-
-    return server_fd;
-}
-
 int handle_connection(struct context* ctx, short revents, short* events_out, int* connection_completed)
 {
-    ssize_t result, max_bytes;
+    ssize_t result;
+    char* buf_end;
 
     /* POLLHUP means that the other end has closed the connection (hung up!). No
        need to continue. */
@@ -126,20 +90,39 @@ int handle_connection(struct context* ctx, short revents, short* events_out, int
     assert(ctx);
     switch (ctx->state) {
     case READING:
-        max_bytes = sizeof(ctx->buf) - ctx->bytes - 1;
         /* Because the socket is in nonblocking mode, we may not get everything
          * at once. If we don't receive the linefeed ending the message, just
-         * try again later. */
-        result = read(ctx->fd, ctx->buf + ctx->bytes, max_bytes);
-        if (result < 0) {
+         * try again later. A client that closes the connection or sends a
+         * message that doesn't fit in the buffer is dropped. */
+        result = read(ctx->fd, ctx->buf + ctx->bytes, sizeof(ctx->buf) - ctx->bytes);
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *events_out = POLLIN;
+            *connection_completed = 0;
+            break;
+        } else if (result < 0) {
             return -1;
+        } else if (result == 0) {
+            *events_out = 0;
+            *connection_completed = 1;
+            break;
         }
+        metrics_record_bytes_in(ctx->metrics, result);
+        buf_end = memchr(ctx->buf + ctx->bytes, '\n', result);
         ctx->bytes += result;
-        ctx->buf_end = memchr(ctx->buf, '\n', ctx->bytes);
-        if (ctx->buf_end) {
+        if (buf_end) {
+            if ((result = ctx->handler->handle(ctx->handler->arg, ctx->buf,
+                                               buf_end - ctx->buf + 1, sizeof(ctx->buf))) < 0) {
+                *events_out = 0;
+                *connection_completed = 1;
+                break;
+            }
             ctx->state = WRITING;
+            ctx->response_len = result;
             ctx->bytes = 0;
-            *events_out = POLLOUT;
+        } else if (ctx->bytes == sizeof(ctx->buf)) {
+            *events_out = 0;
+            *connection_completed = 1;
+            break;
         } else {
             *events_out = POLLIN;
             *connection_completed = 0;
@@ -147,16 +130,20 @@ int handle_connection(struct context* ctx, short revents, short* events_out, int
         }
         // fallthrough
     case WRITING:
-        max_bytes = strlen(ctx->buf) - ctx->bytes;
         /* Similarly as with reading, writing may not write all the bytes at
-         * once, and we may need to wait for the socket to become readable
+         * once, and we may need to wait for the socket to become writable
          * again. */
-        result = write(ctx->fd, ctx->buf + ctx->bytes, max_bytes);
-        if (result < 0) {
+        result = write(ctx->fd, ctx->buf + ctx->bytes, ctx->response_len - ctx->bytes);
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *events_out = POLLOUT;
+            *connection_completed = 0;
+            break;
+        } else if (result < 0) {
             return -1;
         }
+        metrics_record_bytes_out(ctx->metrics, result);
         ctx->bytes += result;
-        if (result == max_bytes) {
+        if (ctx->bytes == ctx->response_len) {
             ctx->state = DONE;
         } else {
             *events_out = POLLOUT;
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "frame.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Serve a nonblocking socket from an event loop. The handler tells which
+ * events it waits for next, and when the connection is completed. */
+struct context;
+struct metrics;
+
+struct context* create_connection(int socket_fd, const struct frame_handler* handler,
+                                  struct metrics* metrics, short* events_out);
+int handle_connection(struct context* ctx, short revents, short* events_out, int* connection_completed);
+void destroy_connection(struct context* ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The message framing shared by all the servers. The servers only decide how
+ * to wait for the socket, and leave reading and writing the messages here.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "frame.h"
+
+static ssize_t echo_frame(void* arg, char* buf, size_t len, size_t size)
+{
+    return len;
+}
+
+const struct frame_handler echo_handler = { &echo_frame, NULL };
+
+int serve_frame(int socket_fd, const struct frame_handler* handler)
+{
+    char buf[FRAME_MAX];
+    char* buf_end = NULL;
+    size_t bytes = 0, written = 0;
+    ssize_t result;
+
+    /* Read until the linefeed. A message longer than the buffer is
+     * dropped. */
+    while (!buf_end) {
+        if (bytes == sizeof(buf)) {
+            return -1;
+        }
+        if ((result = read(socket_fd, buf + bytes, sizeof(buf) - bytes)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (result == 0) {
+            return -1;
+        }
+        buf_end = memchr(buf + bytes, '\n', result);
+        bytes += result;
+    }
+
+    if ((result = handler->handle(handler->arg, buf, buf_end - buf + 1, sizeof(buf))) < 0) {
+        return -1;
+    }
+    bytes = result;
+
+    while (written < bytes) {
+        if ((result = write(socket_fd, buf + written, bytes - written)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += result;
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Messages are framed by a linefeed, and a connection carries one message
+ * and its response. */
+#define FRAME_MAX 65536
+
+/* A frame handler gets a complete message in buf, linefeed included, and
+ * writes the response over it. The buffer holds size bytes. Returns the length
+ * of the response, or -1 to drop the connection. */
+struct frame_handler
+{
+    ssize_t (*handle)(void* arg, char* buf, size_t len, size_t size);
+    void* arg;
+};
+
+extern const struct frame_handler echo_handler;
+
+/* Serve a blocking socket. Returns -1 on error. */
+int serve_frame(int socket_fd, const struct frame_handler* handler);
+
+#ifdef __cplusplus
+}
+#endif
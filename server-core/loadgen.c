@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Load generator for the echo servers. Each client thread opens a connection,
+ * sends a line, waits for the echo and closes the connection, as fast as it
+ * can. Usage: loadgen [-c clients] [-d seconds] [-p port]
+ */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char MESSAGE[] = "Hello, world!\n";
+
+static uint16_t port = 9999;
+static atomic_int running = 1;
+
+struct client
+{
+    pthread_t thread;
+    unsigned long requests;
+    unsigned long failures;
+};
+
+static int request()
+{
+    int fd;
+    char buf[sizeof(MESSAGE)];
+    size_t bytes = 0;
+    ssize_t result;
+    struct sockaddr_in addr;
+    /* Reset the connection on close instead of leaving it in TIME_WAIT, or we
+     * run out of local ports in a few seconds. */
+    const struct linger linger = { 1, 0 };
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        write(fd, MESSAGE, sizeof(MESSAGE) - 1) != sizeof(MESSAGE) - 1) {
+        close(fd);
+        return -1;
+    }
+    while (bytes < sizeof(MESSAGE) - 1) {
+        if ((result = read(fd, buf + bytes, sizeof(buf) - bytes - 1)) <= 0) {
+            close(fd);
+            return -1;
+        }
+        bytes += result;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+    return memcmp(buf, MESSAGE, sizeof(MESSAGE) - 1) ? -1 : 0;
+}
+
+static void* run_client(void* arg)
+{
+    struct client* client = arg;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (request()) {
+            ++client->failures;
+        } else {
+            ++client->requests;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    int opt, i, n_clients = 8, duration = 5;
+    unsigned long requests = 0, failures = 0;
+    struct client* clients;
+    struct timespec start, end;
+    double elapsed;
+
+    while ((opt = getopt(argc, argv, "c:d:p:")) != -1) {
+        switch (opt) {
+        case 'c':
+            n_clients = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-p port]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!(clients = calloc(n_clients, sizeof(struct client)))) {
+        perror("calloc");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n_clients; ++i) {
+        if (pthread_create(&clients[i].thread, NULL, &run_client, &clients[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    sleep(duration);
+    atomic_store(&running, 0);
+    for (i = 0; i < n_clients; ++i) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        failures += clients[i].failures;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%lu requests, %lu failures in %.2f s: %.0f requests/s\n",
+           requests, failures, elapsed, requests / elapsed);
+    free(clients);
+    return 0;
+}
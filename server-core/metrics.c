@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "server.h"
+
+/* Histograms have power of two buckets: bucket i counts the values that are
+ * exactly i bits long, so finding the bucket is a single instruction. */
+#define N_BUCKETS 32
+
+struct histogram
+{
+    atomic_uint_fast64_t buckets[N_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+};
+
+/* Each event loop owns its metrics and is the only writer, so the counters
+ * are updated with plain relaxed loads and stores instead of locked
+ * read-modify-write instructions. The atomics only make it safe to read the
+ * counters from another thread. The struct is cache line aligned so that the
+ * metrics of different loops never share a cache line. */
+struct metrics
+{
+    _Alignas(64) atomic_uint_fast64_t accepts;
+    atomic_int_fast64_t active_connections;
+    atomic_uint_fast64_t bytes_in;
+    atomic_uint_fast64_t bytes_out;
+    struct histogram loop_iteration;
+    struct histogram events_per_wakeup;
+    struct histogram handler_latency;
+};
+
+static const int ADMIN_BACKLOG = 4;
+
+static void add(atomic_uint_fast64_t* counter, uint64_t value)
+{
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+        memory_order_relaxed);
+}
+
+static void observe(struct histogram* histogram, uint64_t value)
+{
+    const int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    add(&histogram->buckets[bucket < N_BUCKETS ? bucket : N_BUCKETS - 1], 1);
+    add(&histogram->count, 1);
+    add(&histogram->sum, value);
+}
+
+struct metrics* create_metrics()
+{
+    struct metrics* metrics = aligned_alloc(_Alignof(struct metrics), sizeof(struct metrics));
+    if (metrics) {
+        memset(metrics, 0, sizeof(struct metrics));
+    }
+    return metrics;
+}
+
+void destroy_metrics(struct metrics* metrics)
+{
+    free(metrics);
+}
+
+/* Monotonic time in microseconds. */
+uint64_t metrics_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void metrics_record_accept(struct metrics* metrics)
+{
+    add(&metrics->accepts, 1);
+    atomic_store_explicit(
+        &metrics->active_connections,
+        atomic_load_explicit(&metrics->active_connections, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+}
+
+void metrics_record_close(struct metrics* metrics)
+{
+    atomic_store_explicit(
+        &metrics->active_connections,
+        atomic_load_explicit(&metrics->active_connections, memory_order_relaxed) - 1,
+        memory_order_relaxed);
+}
+
+void metrics_record_bytes_in(struct metrics* metrics, size_t bytes)
+{
+    add(&metrics->bytes_in, bytes);
+}
+
+void metrics_record_bytes_out(struct metrics* metrics, size_t bytes)
+{
+    add(&metrics->bytes_out, bytes);
+}
+
+void metrics_record_wakeup(struct metrics* metrics, int events, uint64_t started)
+{
+    observe(&metrics->events_per_wakeup, events);
+    observe(&metrics->loop_iteration, metrics_now() - started);
+}
+
+void metrics_record_handler(struct metrics* metrics, uint64_t started)
+{
+    observe(&metrics->handler_latency, metrics_now() - started);
+}
+
+static uint64_t load(const atomic_uint_fast64_t* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static size_t format_histogram(char* buf, size_t size, const char* name,
+                               const char* help, const struct histogram* histogram)
+{
+    size_t len;
+    uint64_t cumulative = 0;
+    int i;
+
+    len = snprintf(buf, size, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < N_BUCKETS - 1 && len < size; ++i) {
+        cumulative += load(&histogram->buckets[i]);
+        len += snprintf(buf + len, size - len, "%s_bucket{le=\"%llu\"} %llu\n",
+                        name, (1ULL << i) - 1, (unsigned long long)cumulative);
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len,
+                        "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n%s_count %llu\n",
+                        name, (unsigned long long)load(&histogram->count),
+                        name, (unsigned long long)load(&histogram->sum),
+                        name, (unsigned long long)load(&histogram->count));
+    }
+    return len < size ? len : size;
+}
+
+/* Format the metrics in the Prometheus text exposition format. */
+static size_t format_metrics(const struct metrics* metrics, char* buf, size_t size)
+{
+    size_t len;
+
+    len = snprintf(
+        buf, size,
+        "# HELP server_accepts_total Accepted connections.\n"
+        "# TYPE server_accepts_total counter\n"
+        "server_accepts_total %llu\n"
+        "# HELP server_active_connections Connections currently open.\n"
+        "# TYPE server_active_connections gauge\n"
+        "server_active_connections %lld\n"
+        "# HELP server_received_bytes_total Bytes read from clients.\n"
+        "# TYPE server_received_bytes_total counter\n"
+        "server_received_bytes_total %llu\n"
+        "# HELP server_sent_bytes_total Bytes written to clients.\n"
+        "# TYPE server_sent_bytes_total counter\n"
+        "server_sent_bytes_total %llu\n",
+        (unsigned long long)load(&metrics->accepts),
+        (long long)atomic_load_explicit(&metrics->active_connections, memory_order_relaxed),
+        (unsigned long long)load(&metrics->bytes_in),
+        (unsigned long long)load(&metrics->bytes_out));
+    len = len < size ? len : size;
+    len += format_histogram(
+        buf + len, size - len, "server_loop_iteration_microseconds",
+        "Time spent handling the events of one wakeup.", &metrics->loop_iteration);
+    len += format_histogram(
+        buf + len, size - len, "server_events_per_wakeup",
+        "Ready file descriptors per wakeup.", &metrics->events_per_wakeup);
+    len += format_histogram(
+        buf + len, size - len, "server_handler_latency_microseconds",
+        "Time spent in a connection handler per event.", &metrics->handler_latency);
+    return len;
+}
+
+/* Returns -1 if port is zero, which turns the admin socket off. */
+int create_admin_server(uint16_t port)
+{
+    int admin_fd;
+    struct sockaddr_in addr;
+    const int reuseaddr = 1;
+
+    if (!port) {
+        return -1;
+    }
+
+    if ((admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        handle_error("socket");
+    }
+
+    if (setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr,
+                   sizeof(reuseaddr)) < 0) {
+        handle_error("setsockopt");
+    }
+
+    /* The admin socket is only reachable from the local machine. */
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(admin_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        handle_error("bind");
+    }
+
+    if (listen(admin_fd, ADMIN_BACKLOG) < 0) {
+        handle_error("listen");
+    }
+
+    return admin_fd;
+}
+
+void serve_metrics(const struct metrics* metrics, int admin_fd)
+{
+    static char buf[16384];
+    char header[128];
+    size_t len, header_len;
+    int socket_fd;
+
+    /* The request is not even read: whoever connects to the admin socket gets
+     * the metrics in a minimal HTTP response, which is enough for both curl
+     * and Prometheus. The response fits in the socket buffer, so writing it
+     * does not block the event loop. */
+    if ((socket_fd = accept4(admin_fd, NULL, NULL, SOCK_NONBLOCK)) < 0) {
+        return;
+    }
+    len = format_metrics(metrics, buf, sizeof(buf));
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n\r\n", len);
+    if (write(socket_fd, header, header_len) == (ssize_t)header_len) {
+        write(socket_fd, buf, len);
+    }
+    shutdown(socket_fd, SHUT_WR);
+    close(socket_fd);
+}
+
+void dump_metrics(const struct metrics* metrics, int fd)
+{
+    static char buf[16384];
+    size_t len;
+
+    len = format_metrics(metrics, buf, sizeof(buf));
+    if (write(fd, buf, len) != (ssize_t)len) {
+        perror("dump_metrics");
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct metrics;
+
+struct metrics* create_metrics();
+void destroy_metrics(struct metrics* metrics);
+
+uint64_t metrics_now();
+
+void metrics_record_accept(struct metrics* metrics);
+void metrics_record_close(struct metrics* metrics);
+void metrics_record_bytes_in(struct metrics* metrics, size_t bytes);
+void metrics_record_bytes_out(struct metrics* metrics, size_t bytes);
+void metrics_record_wakeup(struct metrics* metrics, int events, uint64_t started);
+void metrics_record_handler(struct metrics* metrics, uint64_t started);
+
+/* The port of the admin socket unless told otherwise. Every server running
+ * on the same machine needs a port of its own. */
+#define DEFAULT_ADMIN_PORT 9998
+
+int create_admin_server(uint16_t port);
+void serve_metrics(const struct metrics* metrics, int admin_fd);
+void dump_metrics(const struct metrics* metrics, int fd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A readiness backend that the servers can switch between. poll() passes the
+ * whole list of file descriptors to the kernel on every call, so its cost
+ * grows with the number of connections. epoll keeps the list in the kernel,
+ * and only returns the file descriptors that are ready.
+ */
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "poller.h"
+
+/* The epoll flags have the same values as the poll flags, so the events are
+ * passed through as they are. */
+_Static_assert(EPOLLIN == POLLIN && EPOLLOUT == POLLOUT &&
+               EPOLLERR == POLLERR && EPOLLHUP == POLLHUP,
+               "epoll and poll flags differ");
+
+struct poller_ops
+{
+    int (*add)(struct poller* poller, int fd, short events, void* data);
+    int (*modify)(struct poller* poller, int fd, short events, void* data);
+    int (*remove)(struct poller* poller, int fd);
+    int (*wait)(struct poller* poller, struct poller_event* events, int max_events, int timeout);
+    void (*destroy)(struct poller* poller);
+};
+
+struct poller
+{
+    const struct poller_ops* ops;
+};
+
+/* The poll() backend keeps the pollfds in a dense array, so that poll() has
+ * no holes to skip, and an index from the file descriptors to their position
+ * in it. Removing moves the last pollfd into the hole. */
+struct poll_poller
+{
+    struct poller base;
+    struct pollfd* pollfds;
+    int* fds;
+    void** data;
+    int n_fds;
+    int max_fds;
+    int* index;
+    int index_size;
+};
+
+static int poll_find(const struct poll_poller* poller, int fd)
+{
+    return fd >= 0 && fd < poller->index_size ? poller->index[fd] : -1;
+}
+
+static int poll_modify(struct poller* base, int fd, short events, void* data)
+{
+    struct poll_poller* poller = (struct poll_poller*)base;
+    const int i = poll_find(poller, fd);
+
+    if (i < 0) {
+        return -1;
+    }
+    /* A negative file descriptor is skipped altogether, so that not even
+     * POLLHUP is reported while nobody is interested in the events. */
+    poller->pollfds[i].fd = events ? fd : -1;
+    poller->pollfds[i].events = events;
+    poller->pollfds[i].revents = 0;
+    poller->data[i] = data;
+    return 0;
+}
+
+static int poll_add(struct poller* base, int fd, short events, void* data)
+{
+    struct poll_poller* poller = (struct poll_poller*)base;
+    int size, i;
+    void* p;
+
+    if (fd < 0 || poll_find(poller, fd) >= 0) {
+        return -1;
+    }
+    if (fd >= poller->index_size) {
+        for (size = poller->index_size * 2; size <= fd; size *= 2);
+        if (!(p = realloc(poller->index, size * sizeof(int)))) {
+            return -1;
+        }
+        poller->index = p;
+        for (i = poller->index_size; i < size; ++i) {
+            poller->index[i] = -1;
+        }
+        poller->index_size = size;
+    }
+    if (poller->n_fds == poller->max_fds) {
+        size = poller->max_fds * 2;
+        if (!(p = realloc(poller->pollfds, size * sizeof(struct pollfd)))) {
+            return -1;
+        }
+        poller->pollfds = p;
+        if (!(p = realloc(poller->fds, size * sizeof(int)))) {
+            return -1;
+        }
+        poller->fds = p;
+        if (!(p = realloc(poller->data, size * sizeof(void*)))) {
+            return -1;
+        }
+        poller->data = p;
+        poller->max_fds = size;
+    }
+    i = poller->n_fds++;
+    poller->fds[i] = fd;
+    poller->index[fd] = i;
+    return poll_modify(base, fd, events, data);
+}
+
+static int poll_remove(struct poller* base, int fd)
+{
+    struct poll_poller* poller = (struct poll_poller*)base;
+    const int i = poll_find(poller, fd);
+    int last;
+
+    if (i < 0) {
+        return -1;
+    }
+    last = --poller->n_fds;
+    poller->pollfds[i] = poller->pollfds[last];
+    poller->fds[i] = poller->fds[last];
+    poller->data[i] = poller->data[last];
+    poller->index[poller->fds[i]] = i;
+    poller->index[fd] = -1;
+    return 0;
+}
+
+static int poll_wait(struct poller* base, struct poller_event* events, int max_events, int timeout)
+{
+    struct poll_poller* poller = (struct poll_poller*)base;
+    int n_ready, n_events = 0, i;
+
+    if ((n_ready = poll(poller->pollfds, poller->n_fds, timeout)) <= 0) {
+        return n_ready;
+    }
+    for (i = 0; i < poller->n_fds && n_events < n_ready && n_events < max_events; ++i) {
+        if (poller->pollfds[i].revents) {
+            events[n_events].data = poller->data[i];
+            events[n_events].revents = poller->pollfds[i].revents;
+            ++n_events;
+        }
+    }
+    return n_events;
+}
+
+static void poll_destroy(struct poller* base)
+{
+    struct poll_poller* poller = (struct poll_poller*)base;
+
+    free(poller->pollfds);
+    free(poller->fds);
+    free(poller->data);
+    free(poller->index);
+    free(poller);
+}
+
+static const struct poller_ops POLL_OPS = {
+    &poll_add, &poll_modify, &poll_remove, &poll_wait, &poll_destroy,
+};
+
+static struct poller* create_poll_poller(int max_events)
+{
+    struct poll_poller* poller = calloc(1, sizeof(struct poll_poller));
+
+    if (!poller) {
+        return NULL;
+    }
+    poller->base.ops = &POLL_OPS;
+    poller->max_fds = max_events > 0 ? max_events : 16;
+    poller->index_size = 64;
+    poller->pollfds = malloc(poller->max_fds * sizeof(struct pollfd));
+    poller->fds = malloc(poller->max_fds * sizeof(int));
+    poller->data = malloc(poller->max_fds * sizeof(void*));
+    poller->index = malloc(poller->index_size * sizeof(int));
+    if (!poller->pollfds || !poller->fds || !poller->data || !poller->index) {
+        poll_destroy(&poller->base);
+        return NULL;
+    }
+    memset(poller->index, -1, poller->index_size * sizeof(int));
+    return &poller->base;
+}
+
+/* The epoll backend leaves the bookkeeping to the kernel, which also stores
+ * the data pointers. Only the buffer for the ready events is needed. */
+struct epoll_poller
+{
+    struct poller base;
+    int epoll_fd;
+    struct epoll_event* ready;
+    int max_ready;
+};
+
+static int epoll_control(struct poller* base, int op, int fd, short events, void* data)
+{
+    struct epoll_poller* poller = (struct epoll_poller*)base;
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = (unsigned short)events;
+    event.data.ptr = data;
+    return epoll_ctl(poller->epoll_fd, op, fd, &event);
+}
+
+static int epoll_add(struct poller* base, int fd, short events, void* data)
+{
+    return epoll_control(base, EPOLL_CTL_ADD, fd, events, data);
+}
+
+static int epoll_modify(struct poller* base, int fd, short events, void* data)
+{
+    return epoll_control(base, EPOLL_CTL_MOD, fd, events, data);
+}
+
+static int epoll_remove(struct poller* base, int fd)
+{
+    return epoll_control(base, EPOLL_CTL_DEL, fd, 0, NULL);
+}
+
+static int epoll_wait_events(struct poller* base, struct poller_event* events, int max_events, int timeout)
+{
+    struct epoll_poller* poller = (struct epoll_poller*)base;
+    int n_events, i;
+
+    if (max_events > poller->max_ready) {
+        max_events = poller->max_ready;
+    }
+    if ((n_events = epoll_wait(poller->epoll_fd, poller->ready, max_events, timeout)) <= 0) {
+        return n_events;
+    }
+    for (i = 0; i < n_events; ++i) {
+        events[i].data = poller->ready[i].data.ptr;
+        events[i].revents = (short)poller->ready[i].events;
+    }
+    return n_events;
+}
+
+static void epoll_destroy(struct poller* base)
+{
+    struct epoll_poller* poller = (struct epoll_poller*)base;
+
+    if (poller->epoll_fd >= 0) {
+        close(poller->epoll_fd);
+    }
+    free(poller->ready);
+    free(poller);
+}
+
+static const struct poller_ops EPOLL_OPS = {
+    &epoll_add, &epoll_modify, &epoll_remove, &epoll_wait_events, &epoll_destroy,
+};
+
+static struct poller* create_epoll_poller(int max_events)
+{
+    struct epoll_poller* poller = calloc(1, sizeof(struct epoll_poller));
+
+    if (!poller) {
+        return NULL;
+    }
+    poller->base.ops = &EPOLL_OPS;
+    poller->max_ready = max_events > 0 ? max_events : 16;
+    poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    poller->ready = malloc(poller->max_ready * sizeof(struct epoll_event));
+    if (poller->epoll_fd < 0 || !poller->ready) {
+        epoll_destroy(&poller->base);
+        return NULL;
+    }
+    return &poller->base;
+}
+
+static const char* const BACKEND_NAMES[] = { "poll", "epoll" };
+
+int parse_poller_backend(const char* name, enum poller_backend* backend)
+{
+    if (!strcmp(name, BACKEND_NAMES[POLLER_POLL])) {
+        *backend = POLLER_POLL;
+    } else if (!strcmp(name, BACKEND_NAMES[POLLER_EPOLL])) {
+        *backend = POLLER_EPOLL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char* poller_backend_name(enum poller_backend backend)
+{
+    return BACKEND_NAMES[backend];
+}
+
+/* max_events is how many events one poller_wait() call can return. The
+ * number of file descriptors is not limited. */
+struct poller* create_poller(enum poller_backend backend, int max_events)
+{
+    switch (backend) {
+    case POLLER_POLL:
+        return create_poll_poller(max_events);
+    case POLLER_EPOLL:
+        return create_epoll_poller(max_events);
+    }
+    return NULL;
+}
+
+int poller_add(struct poller* poller, int fd, short events, void* data)
+{
+    return poller->ops->add(poller, fd, events, data);
+}
+
+int poller_modify(struct poller* poller, int fd, short events, void* data)
+{
+    return poller->ops->modify(poller, fd, events, data);
+}
+
+int poller_remove(struct poller* poller, int fd)
+{
+    return poller->ops->remove(poller, fd);
+}
+
+int poller_wait(struct poller* poller, struct poller_event* events, int max_events, int timeout)
+{
+    return poller->ops->wait(poller, events, max_events, timeout);
+}
+
+void destroy_poller(struct poller* poller)
+{
+    poller->ops->destroy(poller);
+}
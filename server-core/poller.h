@@ -0,0 +1,35 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum poller_backend
+{
+    POLLER_POLL,
+    POLLER_EPOLL,
+};
+
+/* The events are POLLIN, POLLOUT, POLLERR and POLLHUP regardless of the
+ * backend. */
+struct poller_event
+{
+    void* data;
+    short revents;
+};
+
+struct poller;
+
+int parse_poller_backend(const char* name, enum poller_backend* backend);
+const char* poller_backend_name(enum poller_backend backend);
+
+struct poller* create_poller(enum poller_backend backend, int max_events);
+int poller_add(struct poller* poller, int fd, short events, void* data);
+int poller_modify(struct poller* poller, int fd, short events, void* data);
+int poller_remove(struct poller* poller, int fd);
+int poller_wait(struct poller* poller, struct poller_event* events, int max_events, int timeout);
+void destroy_poller(struct poller* poller);
+
+#ifdef __cplusplus
+}
+#endif
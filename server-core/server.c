@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Setting up the listening socket and the connections, shared by all the
+ * servers. Performance related socket options are decided here once, and the
+ * servers only choose which ones to turn on.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "server.h"
+
+static const int ENABLE = 1;
+static const uint16_t PORT = 9999;
+static const int SOCKET_BACKLOG = 10;
+
+void init_server_options(struct server_options* options)
+{
+    options->port = PORT;
+    options->backlog = SOCKET_BACKLOG;
+    options->reuseport = 0;
+    options->nonblocking = 0;
+    options->nodelay = 0;
+    options->rcvbuf = 0;
+    options->sndbuf = 0;
+    options->backend = POLLER_POLL;
+    options->admin_port = DEFAULT_ADMIN_PORT;
+}
+
+int parse_int_option(const char* arg, int min, int max, int* value)
+{
+    char* end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || n < min || n > max) {
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+int parse_server_option(struct server_options* options, int opt, const char* arg)
+{
+    int port;
+
+    switch (opt) {
+    case 'p':
+        /* Port zero would bind to whatever port the kernel picks. */
+        if (parse_int_option(arg, 1, UINT16_MAX, &port)) {
+            return -1;
+        }
+        options->port = port;
+        return 0;
+    case 'b':
+        return parse_int_option(arg, 1, INT_MAX, &options->backlog);
+    case 'r':
+        options->reuseport = 1;
+        return 0;
+    case 'n':
+        options->nodelay = 1;
+        return 0;
+    case 'R':
+        return parse_int_option(arg, 0, INT_MAX, &options->rcvbuf);
+    case 'S':
+        return parse_int_option(arg, 0, INT_MAX, &options->sndbuf);
+    case 'e':
+        return parse_poller_backend(arg, &options->backend);
+    case 'a':
+        if (parse_int_option(arg, 0, UINT16_MAX, &port)) {
+            return -1;
+        }
+        options->admin_port = port;
+        return 0;
+    }
+    return -1;
+}
+
+void handle_error(const char* s)
+{
+    perror(s);
+    exit(1);
+}
+
+int create_server_with(const struct server_options* options)
+{
+    int server_fd;
+    struct sockaddr_in addr;
+
+    /* The listening socket is never inherited by accident. A server that
+     * wants to pass it to another process does it explicitly. */
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC |
+                            (options->nonblocking ? SOCK_NONBLOCK : 0), 0)) < 0) {
+        handle_error("socket");
+    }
+
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &ENABLE,
+                   sizeof(ENABLE)) < 0) {
+        handle_error("setsockopt");
+    }
+
+    /* With SO_REUSEPORT several processes can listen on the same port, and
+     * the kernel balances the connections between them. */
+    if (options->reuseport &&
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &ENABLE, sizeof(ENABLE)) < 0) {
+        handle_error("setsockopt SO_REUSEPORT");
+    }
+
+    /* The receive buffer size must be set before listen(), because the TCP
+     * window is negotiated during the handshake. The accepted sockets inherit
+     * both sizes from the listening socket. */
+    if (options->rcvbuf > 0 &&
+        setsockopt(server_fd, SOL_SOCKET, SO_RCVBUF, &options->rcvbuf,
+                   sizeof(options->rcvbuf)) < 0) {
+        handle_error("setsockopt SO_RCVBUF");
+    }
+    if (options->sndbuf > 0 &&
+        setsockopt(server_fd, SOL_SOCKET, SO_SNDBUF, &options->sndbuf,
+                   sizeof(options->sndbuf)) < 0) {
+        handle_error("setsockopt SO_SNDBUF");
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options->port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        handle_error("bind");
+    }
+
+    if (listen(server_fd, options->backlog) < 0) {
+        handle_error("listen");
+    }
+
+    return server_fd;
+}
+
+/* Accept a connection and set it up according to the options. With a
+ * nonblocking listening socket the connection may be gone by the time we get
+ * to accept it, so -1 with errno set to EAGAIN is not an error. */
+int accept_connection(int server_fd, const struct server_options* options)
+{
+    int socket_fd;
+
+    /* accept4() sets the flags atomically, saving the fcntl() calls. Without
+     * SOCK_CLOEXEC a client socket would leak into a process exec'd by a
+     * server handing off its listening socket. */
+    if ((socket_fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC |
+                             (options->nonblocking ? SOCK_NONBLOCK : 0))) < 0) {
+        return -1;
+    }
+
+    /* The responses are small and written in one go, so there is nothing to
+     * gain from Nagle's algorithm delaying them. */
+    if (options->nodelay &&
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &ENABLE, sizeof(ENABLE)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "poller.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How the listening socket and the connections accepted from it are set up.
+ * Buffer sizes of zero keep the kernel defaults. The servers with metrics
+ * serve them on admin_port, and an admin_port of zero turns that off. */
+struct server_options
+{
+    uint16_t port;
+    int backlog;
+    int reuseport;
+    int nonblocking;
+    int nodelay;
+    int rcvbuf;
+    int sndbuf;
+    enum poller_backend backend;
+    uint16_t admin_port;
+};
+
+/* The command line options understood by parse_server_option(), for getopt()
+ * and for the usage message. The blocking servers poll only a few file
+ * descriptors and serve no metrics, so they take the options without -e and
+ * -a. */
+#define SERVER_BLOCKING_OPTSTRING "p:b:rnR:S:"
+#define SERVER_BLOCKING_USAGE "[-p port] [-b backlog] [-r] [-n] [-R rcvbuf] [-S sndbuf]"
+#define SERVER_OPTSTRING SERVER_BLOCKING_OPTSTRING "e:a:"
+#define SERVER_USAGE SERVER_BLOCKING_USAGE " [-e poll|epoll] [-a admin_port]"
+
+void init_server_options(struct server_options* options);
+int parse_server_option(struct server_options* options, int opt, const char* arg);
+
+/* Parse a whole decimal number between min and max, or return -1. */
+int parse_int_option(const char* arg, int min, int max, int* value);
+
+/* Print the error and exit. Marked noreturn, so that the compiler knows that
+ * nothing after a failed check runs with the values it left unset. */
+void handle_error(const char* s) __attribute__((noreturn));
+
+int create_server_with(const struct server_options* options);
+int accept_connection(int server_fd, const struct server_options* options);
+
+#ifdef __cplusplus
+}
+#endif
@@ -20,67 +20,27 @@
  * SOFTWARE.
  */
 
-#include <arpa/inet.h>
+/*
+ * The connection handler shared by the servers in this directory. The
+ * framing comes from ../server-core/frame.c, what's left here is just
+ * logging the message before echoing it back.
+ */
+
 #include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <unistd.h>
 
-const int REUSEADDR = 1;
-const uint16_t PORT = 9999;
-const int SOCKET_BACKLOG = 10;
+#include "frame.h"
 
-void handle_error(const char* s)
+static ssize_t log_frame(void* arg, char* buf, size_t len, size_t size)
 {
-    perror(s);
-    exit(1);
+    fprintf(stderr, "Message received: %.*s", (int)len, buf);
+    return len;
 }
 
-int create_server()
-{
-    int server_fd;
-    struct sockaddr_in addr;
-
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        handle_error("socket");
-    }
-
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &REUSEADDR,
-                   sizeof(REUSEADDR)) < 0) {
-        handle_error("setsockopt");
-    }
+static const struct frame_handler log_handler = { &log_frame, NULL };
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        handle_error("bind");
-    }
-
-    if (listen(server_fd, SOCKET_BACKLOG) < 0) {
-        handle_error("listen");
-    }
-
-    return server_fd;
-}
-
-void handle_connection(int socket_fd)
+/* A misbehaving client is not a reason to take the whole server down, so
+ * errors are only reported to the caller. */
+int handle_connection(int socket_fd)
 {
-    char buf[1024];
-    char* buf_end;
-    ssize_t len;
-
-    memset(buf, 0, sizeof(buf));
-    if ((len = read(socket_fd, buf, sizeof(buf) - 1)) < 0) {
-        handle_error("read");
-    }
-    buf_end = memchr(buf, '\n', len);
-    if (buf_end) {
-        fprintf(stderr, "Message received: %s", buf);
-        if (write(socket_fd, buf, strlen(buf)) != strlen(buf)) {
-            handle_error("write");
-        }
-    }
+    return serve_frame(socket_fd, &log_handler);
 }
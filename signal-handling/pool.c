@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A fixed pool of worker threads serving connections that the accepting
+ * thread pushes to a lock-free queue. The queue itself never blocks, so the
+ * sleeping and waking up happens on the side:
+ *
+ * - Workers sleep on a semaphore counting the items in the queue.
+ *
+ * - When the queue is full, the accepting thread polls an eventfd that a
+ *   worker writes to after it has made space in the queue.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "queue.h"
+#include "server.h"
+
+int handle_connection(int socket_fd);
+
+struct pool
+{
+    struct queue* queue;
+    sem_t items;
+    int space_fd;
+    atomic_int producer_waiting;
+    atomic_int stopping;
+    int n_workers;
+    pthread_t workers[];
+};
+
+static void* run_worker(void* arg)
+{
+    struct pool* pool = arg;
+    const uint64_t one = 1;
+    int socket_fd;
+
+    while (1) {
+        while (sem_wait(&pool->items) && errno == EINTR) {
+        }
+        /* Every post of the semaphore is either an item in the queue, or a
+         * request to stop. A worker only stops when the queue is empty, so
+         * the connections already queued are served before shutting down. */
+        if (queue_pop(pool->queue, &socket_fd)) {
+            if (atomic_load(&pool->stopping)) {
+                break;
+            }
+            continue;
+        }
+        if (atomic_exchange(&pool->producer_waiting, 0)) {
+            if (write(pool->space_fd, &one, sizeof(one)) != sizeof(one)) {
+                handle_error("write space_fd");
+            }
+        }
+        handle_connection(socket_fd);
+        close(socket_fd);
+    }
+    return NULL;
+}
+
+struct pool* create_pool(int n_workers, size_t queue_size)
+{
+    struct pool* pool;
+    int i;
+
+    if (!(pool = malloc(sizeof(struct pool) + n_workers * sizeof(pthread_t)))) {
+        handle_error("malloc");
+    }
+    if (!(pool->queue = create_queue(queue_size))) {
+        handle_error("create_queue");
+    }
+    if (sem_init(&pool->items, 0, 0)) {
+        handle_error("sem_init");
+    }
+    if ((pool->space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        handle_error("eventfd");
+    }
+    atomic_init(&pool->producer_waiting, 0);
+    atomic_init(&pool->stopping, 0);
+    pool->n_workers = n_workers;
+
+    /* The workers inherit the signal mask of the calling thread, so they
+     * leave the signals to the signalfd. */
+    for (i = 0; i < n_workers; ++i) {
+        if ((errno = pthread_create(&pool->workers[i], NULL, &run_worker, pool))) {
+            handle_error("pthread_create");
+        }
+    }
+    return pool;
+}
+
+/* Push a connection to the queue. Returns -1 if the queue is full, in which
+ * case the caller should wait for pool_space_fd() to become readable and try
+ * again. */
+int pool_submit(struct pool* pool, int socket_fd)
+{
+    uint64_t value;
+
+    /* Clear a stale notification, so that the caller doesn't wake up for
+     * nothing. */
+    if (read(pool->space_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        handle_error("read space_fd");
+    }
+    if (queue_push(pool->queue, socket_fd)) {
+        /* Tell the workers we're waiting, and try once more in case a worker
+         * made space before it saw the flag. */
+        atomic_store(&pool->producer_waiting, 1);
+        if (queue_push(pool->queue, socket_fd)) {
+            return -1;
+        }
+    }
+    sem_post(&pool->items);
+    return 0;
+}
+
+int pool_space_fd(const struct pool* pool)
+{
+    return pool->space_fd;
+}
+
+/* Let the workers finish the connections they have, and the ones still in the
+ * queue, and wait for them until the deadline. If the deadline passes, the
+ * remaining workers are left running and die with the process. */
+void destroy_pool(struct pool* pool, const struct timespec* deadline)
+{
+    struct timespec realtime_deadline, now_monotonic, now_realtime;
+    int i, finished = 1;
+
+    /* pthread_timedjoin_np() takes a CLOCK_REALTIME deadline. */
+    clock_gettime(CLOCK_MONOTONIC, &now_monotonic);
+    clock_gettime(CLOCK_REALTIME, &now_realtime);
+    realtime_deadline.tv_sec = now_realtime.tv_sec + deadline->tv_sec - now_monotonic.tv_sec;
+    realtime_deadline.tv_nsec = now_realtime.tv_nsec + deadline->tv_nsec - now_monotonic.tv_nsec;
+    while (realtime_deadline.tv_nsec < 0) {
+        realtime_deadline.tv_nsec += 1000000000;
+        --realtime_deadline.tv_sec;
+    }
+    while (realtime_deadline.tv_nsec >= 1000000000) {
+        realtime_deadline.tv_nsec -= 1000000000;
+        ++realtime_deadline.tv_sec;
+    }
+
+    atomic_store(&pool->stopping, 1);
+    for (i = 0; i < pool->n_workers; ++i) {
+        sem_post(&pool->items);
+    }
+    for (i = 0; i < pool->n_workers; ++i) {
+        if (pthread_timedjoin_np(pool->workers[i], NULL, &realtime_deadline)) {
+            finished = 0;
+            break;
+        }
+    }
+    if (!finished) {
+        /* The workers may still be using the pool. */
+        fprintf(stderr, "Workers did not finish before the deadline\n");
+        return;
+    }
+
+    close(pool->space_fd);
+    sem_destroy(&pool->items);
+    destroy_queue(pool->queue);
+    free(pool);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+
+struct pool;
+
+struct pool* create_pool(int n_workers, size_t queue_size);
+int pool_submit(struct pool* pool, int socket_fd);
+int pool_space_fd(const struct pool* pool);
+void destroy_pool(struct pool* pool, const struct timespec* deadline);
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2020 Jaakko Moisio
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A bounded multi-producer multi-consumer queue of file descriptors. This is
+ * the array based queue by Dmitry Vyukov:
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Each cell has a sequence number telling whose turn it is to use the cell.
+ * Producers and consumers claim a position with compare-and-swap on their own
+ * counter, and then publish the cell by bumping its sequence number. Neither
+ * side ever waits for a lock.
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "queue.h"
+
+struct cell
+{
+    atomic_size_t sequence;
+    int fd;
+};
+
+struct queue
+{
+    struct cell* cells;
+    size_t mask;
+    /* The producer and consumer counters are on their own cache lines so that
+     * the accepting thread and the workers don't keep stealing the same line
+     * from each other. */
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+};
+
+/* The capacity is rounded up to a power of two, so that positions can be
+ * mapped to cells with a mask. */
+struct queue* create_queue(size_t capacity)
+{
+    struct queue* queue;
+    size_t i, size = 2;
+
+    while (size < capacity) {
+        size *= 2;
+    }
+    if (!(queue = aligned_alloc(_Alignof(struct queue), sizeof(struct queue)))) {
+        return NULL;
+    }
+    if (!(queue->cells = calloc(size, sizeof(struct cell)))) {
+        free(queue);
+        return NULL;
+    }
+    for (i = 0; i < size; ++i) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    return queue;
+}
+
+void destroy_queue(struct queue* queue)
+{
+    free(queue->cells);
+    free(queue);
+}
+
+/* Returns -1 if the queue is full. */
+int queue_push(struct queue* queue, int fd)
+{
+    struct cell* cell;
+    size_t pos, sequence;
+    ptrdiff_t diff;
+
+    pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+        if (diff == 0) {
+            /* The cell is free. Try to claim it. On failure pos is updated
+             * to the current value and we try again. */
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* The cell still holds an item from the previous lap. */
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->fd = fd;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+/* Returns -1 if the queue is empty. */
+int queue_pop(struct queue* queue, int* fd)
+{
+    struct cell* cell;
+    size_t pos, sequence;
+    ptrdiff_t diff;
+
+    pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff = (ptrdiff_t)sequence - (ptrdiff_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->dequeue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* Nothing has been published in the cell yet. */
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *fd = cell->fd;
+    /* Hand the cell over to the producer of the next lap. */
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return 0;
+}
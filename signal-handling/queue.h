@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+
+struct queue;
+
+struct queue* create_queue(size_t capacity);
+void destroy_queue(struct queue* queue);
+
+int queue_push(struct queue* queue, int fd);
+int queue_pop(struct queue* queue, int* fd);
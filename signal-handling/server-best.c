@@ -20,64 +20,375 @@
  * SOFTWARE.
  */
 
+/*
+ * On top of handling signals with signalfd, this server knows how to shut down
+ * and restart without dropping connections:
+ *
+ * - SIGTERM stops the server gracefully. Clients that have already connected
+ *   are served before exiting, up to a deadline.
+ *
+ * - SIGHUP or SIGUSR2 starts a new copy of the server and passes the listening
+ *   socket to it over a UNIX socket. The listening socket stays open all the
+ *   time, so the connections made during the restart just wait in the backlog
+ *   until the new process picks them up.
+ *
+ * By default the connections are handled in the same thread that polls. With
+ * "-w N" the connections are handed to a pool of N worker threads instead, so
+ * that one slow client doesn't stall everybody else.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-int create_server();
-void handle_connection(int socket_fd);
-void handle_error(const char* s);
+#include "pool.h"
+#include "server.h"
+
+int handle_connection(int socket_fd);
+
+/* The environment variable telling the new process which file descriptor it
+ * receives the listening socket from. */
+static const char HANDOFF_ENV[] = "SERVER_HANDOFF_FD";
+static const int HANDOFF_TIMEOUT_MS = 5000;
+static const int DRAIN_TIMEOUT_S = 10;
+static const size_t QUEUE_SIZE = 256;
 
-int main()
+/* Receive the listening socket from the old process. The file descriptor is
+ * passed as ancillary data with SCM_RIGHTS, see:
+ * https://man7.org/linux/man-pages/man7/unix.7.html */
+static int receive_server(int handoff_fd)
 {
-    int server_fd, socket_fd, signal_fd;
-    struct pollfd pollfds[2];
+    int server_fd;
+    char byte;
+    struct iovec iov = { &byte, sizeof(byte) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(handoff_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(byte)) {
+        handle_error("recvmsg");
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        handle_error("receive_server");
+    }
+    memcpy(&server_fd, CMSG_DATA(cmsg), sizeof(server_fd));
+    return server_fd;
+}
+
+static int send_server(int handoff_fd, int server_fd)
+{
+    char byte = 0;
+    struct iovec iov = { &byte, sizeof(byte) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &server_fd, sizeof(server_fd));
+    return sendmsg(handoff_fd, &msg, 0) == sizeof(byte) ? 0 : -1;
+}
+
+/* Start a new copy of the server and pass the listening socket to it. Returns
+ * zero when the new process has told that it's ready to take over.
+ *
+ * Every other descriptor must be close-on-exec, or the new process would keep
+ * the clients of this one open. The accepted sockets are created that way by
+ * accept_connection(), so that not even a worker serving a client while the
+ * main thread forks leaks it. */
+static int hand_off(char* argv[], int server_fd)
+{
+    int fds[2];
+    pid_t pid;
+    char fd_str[16], ack;
+    struct pollfd pollfd;
+
+    /* fds[0] stays in this process, fds[1] is inherited by the new one. */
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    if (fcntl(fds[1], F_SETFD, 0) < 0) {
+        perror("fcntl");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        snprintf(fd_str, sizeof(fd_str), "%d", fds[1]);
+        setenv(HANDOFF_ENV, fd_str, 1);
+        /* Exec the binary by its name instead of /proc/self/exe, so that a
+         * new version installed at the same path gets started. */
+        execvp(argv[0], argv);
+        perror("execvp");
+        _exit(1);
+    }
+
+    close(fds[1]);
+    pollfd.fd = fds[0];
+    pollfd.events = POLLIN;
+    if (send_server(fds[0], server_fd) ||
+        poll(&pollfd, 1, HANDOFF_TIMEOUT_MS) != 1 ||
+        read(fds[0], &ack, sizeof(ack)) != sizeof(ack)) {
+        /* The new process didn't make it. It may still be starting up, so
+         * kill it before reaping, or it would be left a zombie or, worse,
+         * start serving next to us. Keep serving. */
+        fprintf(stderr, "Handoff to process %d failed\n", pid);
+        close(fds[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    fprintf(stderr, "Handed off to process %d\n", pid);
+    close(fds[0]);
+    return 0;
+}
+
+/* Time left until the deadline. Returns zero if the deadline has passed. */
+static int time_left(const struct timespec* deadline, struct timeval* timeout)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout->tv_sec = deadline->tv_sec - now.tv_sec;
+    timeout->tv_usec = (deadline->tv_nsec - now.tv_nsec) / 1000;
+    if (timeout->tv_usec < 0) {
+        timeout->tv_usec += 1000000;
+        --timeout->tv_sec;
+    }
+    return timeout->tv_sec > 0 || (!timeout->tv_sec && timeout->tv_usec > 0);
+}
+
+/* Serve a connection either in this thread or in the worker pool. If the queue
+ * of the pool is full, wait for space until the deadline. */
+static void serve(struct pool* pool, int socket_fd, const struct timespec* deadline)
+{
+    struct pollfd pollfd;
+    struct timeval timeout;
+
+    if (!pool) {
+        handle_connection(socket_fd);
+        close(socket_fd);
+        return;
+    }
+
+    pollfd.fd = pool_space_fd(pool);
+    pollfd.events = POLLIN;
+    while (pool_submit(pool, socket_fd)) {
+        if (!time_left(deadline, &timeout)) {
+            close(socket_fd);
+            return;
+        }
+        pollfd.revents = 0;
+        if (poll(&pollfd, 1, timeout.tv_sec * 1000 + timeout.tv_usec / 1000 + 1) < 0) {
+            handle_error("poll");
+        }
+    }
+}
+
+/* Serve the clients that are already waiting in the backlog. Closing the
+ * listening socket would reset their connections. To stop a slow client from
+ * holding the server beyond the deadline, the sockets accepted while draining
+ * time out when the deadline passes. */
+static void drain(int server_fd, const struct server_options* options, struct pool* pool,
+                  const struct timespec* deadline)
+{
+    int socket_fd;
+    struct pollfd pollfd;
+    struct timeval timeout;
+
+    pollfd.fd = server_fd;
+    pollfd.events = POLLIN;
+
+    while (1) {
+        if (!time_left(deadline, &timeout)) {
+            fprintf(stderr, "Drain deadline exceeded\n");
+            break;
+        }
+
+        pollfd.revents = 0;
+        if (poll(&pollfd, 1, 0) != 1 || !(pollfd.revents & POLLIN)) {
+            break;
+        }
+        if ((socket_fd = accept_connection(server_fd, options)) < 0) {
+            handle_error("accept");
+        }
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve(pool, socket_fd, deadline);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int server_fd, socket_fd, signal_fd, opt, n_workers = 0, handoff_fd = -1,
+        pending_fd = -1, handed_off = 0;
+    struct pollfd pollfds[3];
+    struct server_options options;
     sigset_t sigset;
     struct signalfd_siginfo siginfo;
+    struct timespec deadline;
+    struct pool* pool = NULL;
+    const char* handoff_env;
+    char ack = 0;
+
+    init_server_options(&options);
+    while ((opt = getopt(argc, argv, "w:" SERVER_BLOCKING_OPTSTRING)) != -1) {
+        if (opt == 'w' ? parse_int_option(optarg, 0, INT_MAX, &n_workers)
+                       : parse_server_option(&options, opt, optarg)) {
+            fprintf(stderr, "Usage: %s [-w workers] " SERVER_BLOCKING_USAGE "\n", argv[0]);
+            return 1;
+        }
+    }
 
     sigemptyset(&sigset);
     sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGHUP);
+    sigaddset(&sigset, SIGUSR2);
     sigprocmask(SIG_SETMASK, &sigset, NULL);
 
-    server_fd = create_server();
+    /* If we were started by hand_off(), the listening socket is inherited
+     * from the old process. create_server_with() makes the listening socket
+     * close-on-exec, because the only way it should get to the new process is
+     * via the handoff. The new process is started with the same arguments, so
+     * it sets up the connections the same way. */
+    if ((handoff_env = getenv(HANDOFF_ENV))) {
+        handoff_fd = atoi(handoff_env);
+        unsetenv(HANDOFF_ENV);
+        server_fd = receive_server(handoff_fd);
+    } else {
+        server_fd = create_server_with(&options);
+    }
     pollfds[0].fd = server_fd;
     pollfds[0].events = POLLIN;
 
-    signal_fd = signalfd(-1, &sigset, 0);
+    signal_fd = signalfd(-1, &sigset, SFD_CLOEXEC);
     pollfds[1].fd = signal_fd;
     pollfds[1].events = POLLIN;
 
+    /* The workers are started after blocking the signals, so that they too
+     * leave the signals to the signalfd. The pool notifies when there's space
+     * in the queue again, but we only listen to it when the queue is full. */
+    if (n_workers > 0) {
+        pool = create_pool(n_workers, QUEUE_SIZE);
+    }
+    pollfds[2].fd = -1;
+    pollfds[2].events = POLLIN;
+
+    /* Tell the old process that we're ready to take over. */
+    if (handoff_fd >= 0) {
+        if (write(handoff_fd, &ack, sizeof(ack)) != sizeof(ack)) {
+            handle_error("write ack");
+        }
+        close(handoff_fd);
+    }
+
     while (1) {
         /* Poll the incoming events. The signals remain blocked. */
         pollfds[0].revents = 0;
         pollfds[1].revents = 0;
-        if (poll(pollfds, 2, -1) < 0) {
+        pollfds[2].revents = 0;
+        if (poll(pollfds, 3, -1) < 0) {
             handle_error("poll");
         }
 
         /* Handle an incoming connection. */
         if (pollfds[0].revents & POLLIN) {
-            if ((socket_fd = accept(server_fd, NULL, NULL)) < 0) {
+            if ((socket_fd = accept_connection(server_fd, &options)) < 0) {
                 handle_error("accept");
             }
-            handle_connection(socket_fd);
-            close(socket_fd);
+            if (!pool) {
+                handle_connection(socket_fd);
+                close(socket_fd);
+            } else if (pool_submit(pool, socket_fd)) {
+                /* The queue is full. Hold on to the connection and stop
+                 * accepting until a worker has made space. The new clients
+                 * wait in the backlog meanwhile. */
+                pending_fd = socket_fd;
+                pollfds[0].fd = -server_fd;
+                pollfds[2].fd = pool_space_fd(pool);
+            }
         }
 
-        /* Check if a signal was received. */
+        /* Retry the connection that didn't fit in the queue. */
+        if (pollfds[2].revents & POLLIN) {
+            if (!pool_submit(pool, pending_fd)) {
+                pending_fd = -1;
+                pollfds[0].fd = server_fd;
+                pollfds[2].fd = -1;
+            }
+        }
+
+        /* Check if a signal was received. SIGTERM stops the server, the
+         * other signals restart it. */
         if (pollfds[1].revents & POLLIN) {
             if (read(signal_fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) {
                 handle_error("read siginfo");
             }
-            break;
+            if (siginfo.ssi_signo == SIGTERM) {
+                break;
+            } else if (!hand_off(argv, server_fd)) {
+                handed_off = 1;
+                break;
+            }
         }
     }
 
+    /* After a handoff the new process owns the listening socket and its
+     * backlog, so there is nothing to drain. The workers still get to finish
+     * the connections they have. */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT_S;
+    if (pending_fd >= 0) {
+        serve(pool, pending_fd, &deadline);
+    }
+    if (!handed_off) {
+        drain(server_fd, &options, pool, &deadline);
+    }
+    if (pool) {
+        destroy_pool(pool, &deadline);
+    }
+
     fprintf(stderr, "Exiting via %s\n", strsignal(siginfo.ssi_signo));
     close(signal_fd);
     close(server_fd);
@@ -20,6 +20,8 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <poll.h>
 #include <signal.h>
@@ -29,9 +31,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-int create_server();
-void handle_connection(int socket_fd);
-void handle_error(const char* s);
+#include "server.h"
+
+int handle_connection(int socket_fd);
 
 volatile sig_atomic_t signal_received = 0;
 
@@ -40,13 +42,22 @@ void handle_signal(int signum)
     signal_received = signum;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-    int server_fd, socket_fd;
+    int server_fd, socket_fd, opt;
     struct pollfd pollfds[1];
+    struct server_options options;
     sigset_t sigset;
     struct sigaction sa;
 
+    init_server_options(&options);
+    while ((opt = getopt(argc, argv, SERVER_BLOCKING_OPTSTRING)) != -1) {
+        if (parse_server_option(&options, opt, optarg)) {
+            fprintf(stderr, "Usage: %s " SERVER_BLOCKING_USAGE "\n", argv[0]);
+            return 1;
+        }
+    }
+
     sigemptyset(&sigset);
     sigaddset(&sigset, SIGTERM);
     sigprocmask(SIG_SETMASK, &sigset, NULL);
@@ -57,7 +68,7 @@ int main()
     sa.sa_flags = 0;
     sigaction(SIGTERM, &sa, NULL);
 
-    server_fd = create_server();
+    server_fd = create_server_with(&options);
     pollfds[0].fd = server_fd;
     pollfds[0].events = POLLIN;
 
@@ -72,7 +83,7 @@ int main()
 
         /* Handle an incoming connection. */
         if (pollfds[0].revents & POLLIN) {
-            if ((socket_fd = accept(server_fd, NULL, NULL)) < 0) {
+            if ((socket_fd = accept_connection(server_fd, &options)) < 0) {
                 handle_error("accept");
             }
             handle_connection(socket_fd);
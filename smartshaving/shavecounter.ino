@@ -11,15 +11,24 @@ const int LED_PIN = 7;
 const long LOADCELL_OFFSET = 159512;
 const long LOADCELL_DIVIDER = 206737;
 const float RAZOR_OFF_THRESHOLD = 1.1f;
+const float RAZOR_OFF_HYSTERESIS = 0.25f;
 const int CHANGE_BLADE_THRESHOLD = 6;
 
+// the weight is filtered with an exponential moving average, a new
+// measurement moves it this far towards the measured weight
+const float FILTER_GAIN = 0.5f;
+// how many conversions at most are taken at a time to confirm a change
+const int MAX_CONVERSIONS = 4;
+// the sleep time is doubled on every wakeup that sees no change, up to this
+// many 8 s watchdog cycles
+const int MAX_SLEEP_CYCLES = 2;
+
 HX711 loadcell {};
 
 int bladeCounter = 0;
 
-const size_t N_MEASUREMENTS = 2;
-float measurements[N_MEASUREMENTS] {};
-size_t measurementIndex = 0;
+float filteredWeight = NAN;
+int sleepCycles = 1;
 
 enum class State {
   RAZOR_ON,
@@ -72,46 +81,69 @@ void setup() {
   loadcell.set_scale(LOADCELL_DIVIDER);
   pinMode(LED_PIN, OUTPUT);
   resetLed();
-  for (auto& measurement : measurements) {
-    measurement = INFINITY;
+}
+
+float measureWeight() {
+  // sleep until the conversion is ready, the DOUT pin going low wakes us up
+  attachInterrupt(digitalPinToInterrupt(LOADCELL_DOUT_PIN), wakeUp, LOW);
+  LowPower.powerDown(SLEEP_FOREVER, ADC_OFF, BOD_OFF);
+  detachInterrupt(digitalPinToInterrupt(LOADCELL_DOUT_PIN));
+
+  const auto weight = loadcell.get_units();
+  if (isnan(filteredWeight)) {
+    filteredWeight = weight;
+  } else {
+    filteredWeight += FILTER_GAIN * (weight - filteredWeight);
+  }
+  return weight;
+}
+
+// weight contradicts the current state only if it's clearly on the other
+// side of the threshold
+bool contradictsState(float weight) {
+  if (currentState == State::RAZOR_ON) {
+    return weight < RAZOR_OFF_THRESHOLD - RAZOR_OFF_HYSTERESIS;
   }
+  return weight > RAZOR_OFF_THRESHOLD + RAZOR_OFF_HYSTERESIS;
 }
 
 void loop() {
-  attachInterrupt(digitalPinToInterrupt(2), wakeUp, LOW);
-  LowPower.powerDown(SLEEP_FOREVER, ADC_OFF, BOD_OFF);
-  detachInterrupt(digitalPinToInterrupt(2));
-
-  // add measurement to ring buffer if we can, ignore if we can't
-  measurements[measurementIndex] = loadcell.get_units();
-  measurementIndex = (measurementIndex + 1) % N_MEASUREMENTS;
-
-  // weight is above or below threshold only if it definitely is
-  auto weightBelowThreshold = true;
-  auto weightAboveThreshold = true;
-  for (auto measurement : measurements) {
-    if (measurement < RAZOR_OFF_THRESHOLD) {
-      weightAboveThreshold = false;
-    } else if (measurement > RAZOR_OFF_THRESHOLD) {
-      weightBelowThreshold = false;
+  // powering up the HX711 costs far more than a conversion, so a measurement
+  // that hints at a change is confirmed while it's still powered, instead of
+  // waiting for the next wakeup
+  auto changing = false;
+  for (auto i = 0; i < MAX_CONVERSIONS; ++i) {
+    if (!contradictsState(measureWeight())) {
+      break;
+    }
+    changing = true;
+    if (contradictsState(filteredWeight)) {
+      break;
     }
   }
 
   // the state machine and transitions
-  switch (currentState) {
-  case State::RAZOR_ON:
-    if (weightBelowThreshold) {
+  if (contradictsState(filteredWeight)) {
+    switch (currentState) {
+    case State::RAZOR_ON:
       transitRazorOff();
-    }
-    break;
-  case State::RAZOR_OFF_CHANGE_BLADE:
-  case State::RAZOR_OFF_IDLE:
-    if (weightAboveThreshold) {
+      break;
+    case State::RAZOR_OFF_CHANGE_BLADE:
+    case State::RAZOR_OFF_IDLE:
       transitRazorOn();
     }
   }
 
+  // sample often while things are happening, and back off while they aren't
+  if (changing) {
+    sleepCycles = 1;
+  } else {
+    sleepCycles = 2 * sleepCycles < MAX_SLEEP_CYCLES ? 2 * sleepCycles : MAX_SLEEP_CYCLES;
+  }
+
   loadcell.power_down();
-  LowPower.powerDown(SLEEP_8S, ADC_OFF, BOD_OFF);
+  for (auto i = 0; i < sleepCycles; ++i) {
+    LowPower.powerDown(SLEEP_8S, ADC_OFF, BOD_OFF);
+  }
   loadcell.power_up();
 }
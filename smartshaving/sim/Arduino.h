@@ -0,0 +1,33 @@
+// Just enough of the Arduino core to compile shavecounter.ino on a PC. The
+// calls that take time advance the clock of the simulator instead of
+// actually waiting.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+using byte = uint8_t;
+
+const int LOW = 0;
+const int HIGH = 1;
+const int INPUT = 0;
+const int OUTPUT = 1;
+
+inline int digitalPinToInterrupt(int pin) {
+  return pin == 2 ? 0 : pin == 3 ? 1 : -1;
+}
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+void delay(unsigned long ms);
+unsigned long millis();
+void attachInterrupt(int interrupt, void (*isr)(), int mode);
+void detachInterrupt(int interrupt);
+
+class SerialClass {
+public:
+  void begin(long) {}
+};
+
+extern SerialClass Serial;
@@ -0,0 +1,17 @@
+// The HX711 load cell amplifier, reading the weight from the trace that the
+// simulator replays. Traces are recorded in the same units that get_units()
+// returns, so the offset and the scale are ignored.
+
+#pragma once
+
+#include "Arduino.h"
+
+class HX711 {
+public:
+  void begin(byte dout, byte pd_sck, byte gain = 128);
+  void set_offset(long offset) {}
+  void set_scale(float scale = 1.f) {}
+  float get_units(byte times = 1);
+  void power_down();
+  void power_up();
+};
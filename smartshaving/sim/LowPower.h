@@ -0,0 +1,34 @@
+// The powerDown() call of the Rocket Scream Low-Power library.
+
+#pragma once
+
+enum period_t {
+  SLEEP_15MS,
+  SLEEP_30MS,
+  SLEEP_60MS,
+  SLEEP_120MS,
+  SLEEP_250MS,
+  SLEEP_500MS,
+  SLEEP_1S,
+  SLEEP_2S,
+  SLEEP_4S,
+  SLEEP_8S,
+  SLEEP_FOREVER
+};
+
+enum adc_t {
+  ADC_OFF,
+  ADC_ON
+};
+
+enum bod_t {
+  BOD_OFF,
+  BOD_ON
+};
+
+class LowPowerClass {
+public:
+  void powerDown(period_t period, adc_t adc, bod_t bod);
+};
+
+extern LowPowerClass LowPower;
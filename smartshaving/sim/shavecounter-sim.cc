@@ -0,0 +1,159 @@
+// Runs the shave counter firmware on a PC against a recorded load cell trace
+// and reports where the battery goes.
+//
+// Usage: shavecounter-sim [-b capacity_mAh] [-v] trace.csv
+
+#include "Arduino.h"
+#include "simulator.hh"
+
+#include "../shavecounter.ino"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+// A razor lift or return, either as it happened in the trace or as the
+// firmware detected it
+struct Event {
+  double time;
+  bool razorOn;
+};
+
+std::vector<Event> findCrossings(const std::vector<sim::Sample>& samples) {
+  std::vector<Event> crossings;
+  auto razorOn = samples.front().weight > RAZOR_OFF_THRESHOLD;
+  for (const auto& sample : samples) {
+    if ((sample.weight > RAZOR_OFF_THRESHOLD) != razorOn) {
+      razorOn = !razorOn;
+      crossings.push_back({sample.time, razorOn});
+    }
+  }
+  return crossings;
+}
+
+struct Latency {
+  int detected {};
+  double sum {};
+  double max {};
+};
+
+void printTime(double time) {
+  const auto seconds = static_cast<long>(time);
+  std::printf("day %ld %02ld:%02ld:%02ld", seconds / 86400 + 1, seconds / 3600 % 24,
+              seconds / 60 % 60, seconds % 60);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  auto capacity = 2000.0;
+  auto verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:v")) != -1) {
+    switch (opt) {
+    case 'b':
+      capacity = std::atof(optarg);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      std::fprintf(stderr, "Usage: %s [-b capacity_mAh] [-v] trace.csv\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    std::fprintf(stderr, "Usage: %s [-b capacity_mAh] [-v] trace.csv\n", argv[0]);
+    return 1;
+  }
+
+  auto& simulator = sim::Simulator::instance();
+  std::vector<sim::Sample> samples;
+  std::vector<Event> detections;
+  try {
+    samples = sim::loadTrace(argv[optind]);
+    simulator.setTrace(samples);
+    simulator.setLedPin(LED_PIN);
+
+    // The state only changes in loop(), and the change is based on the
+    // reading taken in that iteration. The blinking that follows is part of
+    // the cost, not of the latency.
+    setup();
+    auto previousState = currentState;
+    while (simulator.now() < simulator.traceEnd()) {
+      loop();
+      if ((currentState == State::RAZOR_ON) != (previousState == State::RAZOR_ON)) {
+        detections.push_back({simulator.lastReading(), currentState == State::RAZOR_ON});
+        if (verbose) {
+          printTime(simulator.lastReading());
+          std::printf(currentState == State::RAZOR_ON ? ": razor on\n" : ": razor off, blade used %d times\n",
+                      bladeCounter);
+        }
+      }
+      previousState = currentState;
+    }
+  } catch (const std::exception& e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  // Match each detection to the crossing it reacted to: the crossing in the
+  // same direction that happened before it, with no crossing in between.
+  // Crossings left without a detection were missed, for example a razor put
+  // back before the firmware noticed it was lifted.
+  const auto crossings = findCrossings(samples);
+  Latency latencies[2];
+  auto spurious = 0;
+  auto next = crossings.begin();
+  for (const auto& detection : detections) {
+    while (next != crossings.end() && next->time <= detection.time) {
+      ++next;
+    }
+    if (next == crossings.begin() || (next - 1)->razorOn != detection.razorOn) {
+      ++spurious;
+      continue;
+    }
+    auto& latency = latencies[detection.razorOn];
+    const auto elapsed = detection.time - (next - 1)->time;
+    ++latency.detected;
+    latency.sum += elapsed;
+    latency.max = std::max(latency.max, elapsed);
+  }
+
+  const auto days = simulator.now() / 86400;
+  std::printf("Simulated %.2f days: %lu wakeups, %lu load cell readings\n",
+              days, simulator.wakeups(), simulator.readings());
+  for (auto razorOn : {false, true}) {
+    const auto& latency = latencies[razorOn];
+    const auto n = std::count_if(
+      crossings.begin(), crossings.end(), [razorOn](const auto& crossing) { return crossing.razorOn == razorOn; });
+    std::printf("Razor %s: detected %d of %ld, latency mean %.1f s, max %.1f s\n",
+                razorOn ? "returned" : "lifted", latency.detected, static_cast<long>(n),
+                latency.detected ? latency.sum / latency.detected : 0.0, latency.max);
+  }
+  if (spurious) {
+    std::printf("%d detections without a matching change in the trace\n", spurious);
+  }
+
+  const auto total = simulator.totalCharge();
+  std::printf("\n%-30s %12s %7s %13s\n", "", "Time (s)", "Share", "Charge (mAh)");
+  for (auto i = 0; i < static_cast<int>(sim::PowerState::N_STATES); ++i) {
+    const auto state = static_cast<sim::PowerState>(i);
+    std::printf("MCU %-26s %12.1f %6.2f%% %13.3f\n", sim::describe(state), simulator.timeIn(state),
+                100 * simulator.timeIn(state) / simulator.now(), simulator.chargeIn(state));
+  }
+  std::printf("%-30s %12.1f %6.2f%% %13.3f\n", "HX711 and load cell powered", simulator.hx711Time(),
+              100 * simulator.hx711Time() / simulator.now(), simulator.hx711Charge());
+  std::printf("%-30s %12.1f %6.2f%% %13.3f\n", "LED on", simulator.ledTime(),
+              100 * simulator.ledTime() / simulator.now(), simulator.ledCharge());
+  std::printf("%-30s %12s %7s %13.3f\n\n", "Total", "", "", total);
+  std::printf("Average current %.1f uA, %.3f mAh per day, %.0f days with %.0f mAh\n",
+              1000 * 3600 * total / simulator.now(), total / days, capacity / (total / days), capacity);
+  return 0;
+}
@@ -0,0 +1,262 @@
+#include "simulator.hh"
+
+#include "Arduino.h"
+#include "HX711.h"
+#include "LowPower.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+namespace sim {
+
+namespace {
+
+const double WATCHDOG_PERIODS[] {
+  0.015, 0.03, 0.06, 0.12, 0.25, 0.5, 1, 2, 4, 8
+};
+
+double mcuCurrent(PowerState state) {
+  switch (state) {
+  case PowerState::ASLEEP_INTERRUPT:
+    return MCU_POWER_DOWN_MA;
+  case PowerState::ASLEEP_WATCHDOG:
+    return MCU_WATCHDOG_MA;
+  default:
+    return MCU_ACTIVE_MA;
+  }
+}
+
+}
+
+const char* describe(PowerState state) {
+  switch (state) {
+  case PowerState::AWAKE_DELAY:
+    return "awake, in delay()";
+  case PowerState::AWAKE_WAITING_HX711:
+    return "awake, waiting for HX711";
+  case PowerState::AWAKE_WAKING_UP:
+    return "awake, waking up";
+  case PowerState::ASLEEP_INTERRUPT:
+    return "asleep until interrupt";
+  case PowerState::ASLEEP_WATCHDOG:
+    return "asleep until watchdog";
+  default:
+    return "unknown";
+  }
+}
+
+std::vector<Sample> loadTrace(const std::string& path) {
+  std::ifstream file {path};
+  if (!file) {
+    throw std::runtime_error {"Could not open " + path};
+  }
+  std::vector<Sample> samples;
+  std::string line;
+  for (auto lineNumber = 1; std::getline(file, line); ++lineNumber) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields {line};
+    Sample sample;
+    auto comma = ',';
+    if (!(fields >> sample.time >> comma >> sample.weight) || comma != ',') {
+      throw std::runtime_error {path + ":" + std::to_string(lineNumber) + ": expected time,weight"};
+    }
+    if (!samples.empty() && sample.time < samples.back().time) {
+      throw std::runtime_error {path + ":" + std::to_string(lineNumber) + ": time goes backwards"};
+    }
+    samples.push_back(sample);
+  }
+  if (samples.empty()) {
+    throw std::runtime_error {path + ": no samples"};
+  }
+  return samples;
+}
+
+Simulator& Simulator::instance() {
+  static Simulator simulator;
+  return simulator;
+}
+
+void Simulator::setTrace(std::vector<Sample> samples) {
+  trace = std::move(samples);
+  traceIndex = 0;
+}
+
+void Simulator::setLedPin(int pin) {
+  ledPin = pin;
+}
+
+double Simulator::traceEnd() const {
+  return trace.empty() ? 0 : trace.back().time;
+}
+
+float Simulator::weightAt(double time) {
+  // The clock never goes backwards, so the trace is searched from where the
+  // previous lookup left off
+  while (traceIndex + 1 < trace.size() && trace[traceIndex + 1].time <= time) {
+    ++traceIndex;
+  }
+  return trace.empty() ? 0 : trace[traceIndex].weight;
+}
+
+double Simulator::timeIn(PowerState state) const {
+  return stateTime[static_cast<int>(state)];
+}
+
+double Simulator::chargeIn(PowerState state) const {
+  return stateMas[static_cast<int>(state)] / 3600;
+}
+
+double Simulator::totalCharge() const {
+  auto charge = hx711Charge() + ledCharge();
+  for (auto i = 0; i < static_cast<int>(PowerState::N_STATES); ++i) {
+    charge += chargeIn(static_cast<PowerState>(i));
+  }
+  return charge;
+}
+
+void Simulator::advance(double seconds, PowerState state) {
+  const auto i = static_cast<int>(state);
+  stateTime[i] += seconds;
+  stateMas[i] += seconds * mcuCurrent(state);
+  if (hx711On) {
+    hx711OnTime += seconds;
+    hx711Mas += seconds * (HX711_ACTIVE_MA + LOADCELL_MA);
+  } else {
+    hx711Mas += seconds * HX711_POWER_DOWN_MA;
+  }
+  if (ledOn) {
+    ledOnTime += seconds;
+    ledMas += seconds * LED_MA;
+  }
+  clock += seconds;
+}
+
+void Simulator::writePin(int pin, int value) {
+  if (pin == ledPin) {
+    ledOn = value == HIGH;
+  }
+}
+
+void Simulator::attachInterrupt(int interrupt) {
+  attachedInterrupt = interrupt;
+}
+
+void Simulator::detachInterrupt(int interrupt) {
+  if (attachedInterrupt == interrupt) {
+    attachedInterrupt = -1;
+  }
+}
+
+void Simulator::powerDown(double seconds) {
+  advance(seconds, PowerState::ASLEEP_WATCHDOG);
+  advance(MCU_WAKEUP_S, PowerState::AWAKE_WAKING_UP);
+  ++nWakeups;
+}
+
+void Simulator::powerDownUntilInterrupt() {
+  // The only interrupt source on the board is the DOUT pin of the HX711,
+  // which goes low when a conversion is ready. LOW is a level interrupt, so
+  // it fires immediately if the conversion is already waiting.
+  if (attachedInterrupt < 0 || attachedInterrupt != hx711Interrupt || !hx711On) {
+    throw std::runtime_error {"powerDown(SLEEP_FOREVER) would never wake up"};
+  }
+  if (hx711ReadyAt > clock) {
+    advance(hx711ReadyAt - clock, PowerState::ASLEEP_INTERRUPT);
+  }
+  advance(MCU_WAKEUP_S, PowerState::AWAKE_WAKING_UP);
+  ++nWakeups;
+}
+
+void Simulator::hx711Begin(int doutPin) {
+  hx711Interrupt = digitalPinToInterrupt(doutPin);
+  hx711PowerUp();
+  // Setting the gain in begin() clocks out one conversion
+  hx711Read();
+}
+
+void Simulator::hx711PowerUp() {
+  if (!hx711On) {
+    hx711On = true;
+    hx711ReadyAt = clock + HX711_SETTLING_S;
+  }
+}
+
+void Simulator::hx711PowerDown() {
+  hx711On = false;
+}
+
+float Simulator::hx711Read() {
+  if (!hx711On) {
+    throw std::runtime_error {"Reading HX711 while it's powered down would never return"};
+  }
+  if (hx711ReadyAt > clock) {
+    advance(hx711ReadyAt - clock, PowerState::AWAKE_WAITING_HX711);
+  }
+  hx711ReadyAt = clock + HX711_CONVERSION_S;
+  lastReadingTime = clock;
+  ++nReadings;
+  return weightAt(clock);
+}
+
+}
+
+// The mock layers used by the sketch
+
+SerialClass Serial;
+LowPowerClass LowPower;
+
+void pinMode(int pin, int mode) {}
+
+void digitalWrite(int pin, int value) {
+  sim::Simulator::instance().writePin(pin, value);
+}
+
+void delay(unsigned long ms) {
+  sim::Simulator::instance().advance(ms / 1000.0, sim::PowerState::AWAKE_DELAY);
+}
+
+unsigned long millis() {
+  return static_cast<unsigned long>(sim::Simulator::instance().now() * 1000);
+}
+
+void attachInterrupt(int interrupt, void (*isr)(), int mode) {
+  sim::Simulator::instance().attachInterrupt(interrupt);
+}
+
+void detachInterrupt(int interrupt) {
+  sim::Simulator::instance().detachInterrupt(interrupt);
+}
+
+void HX711::begin(byte dout, byte pd_sck, byte gain) {
+  sim::Simulator::instance().hx711Begin(dout);
+}
+
+float HX711::get_units(byte times) {
+  auto& simulator = sim::Simulator::instance();
+  auto sum = 0.f;
+  for (auto i = 0; i < times; ++i) {
+    sum += simulator.hx711Read();
+  }
+  return times > 0 ? sum / times : 0.f;
+}
+
+void HX711::power_down() {
+  sim::Simulator::instance().hx711PowerDown();
+}
+
+void HX711::power_up() {
+  sim::Simulator::instance().hx711PowerUp();
+}
+
+void LowPowerClass::powerDown(period_t period, adc_t adc, bod_t bod) {
+  auto& simulator = sim::Simulator::instance();
+  if (period == SLEEP_FOREVER) {
+    simulator.powerDownUntilInterrupt();
+  } else {
+    simulator.powerDown(sim::WATCHDOG_PERIODS[period]);
+  }
+}
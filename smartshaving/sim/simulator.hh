@@ -0,0 +1,114 @@
+// The simulated board behind the mock Arduino, HX711 and LowPower layers. It
+// keeps a virtual clock, replays a load cell trace and integrates the current
+// drawn by each part over time.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+// Current draw in milliamperes. The figures are typical datasheet values for
+// a 3.3 V, 8 MHz ATmega328P board (Pro Mini with the regulator and the power
+// LED removed) and a 1 kΩ load cell excited by the HX711. Measure your own
+// board and adjust.
+const double MCU_ACTIVE_MA = 3.5;
+const double MCU_POWER_DOWN_MA = 0.0002;
+const double MCU_WATCHDOG_MA = 0.0045;
+const double HX711_ACTIVE_MA = 1.5;
+const double HX711_POWER_DOWN_MA = 0.0005;
+const double LOADCELL_MA = 3.0;
+const double LED_MA = 10.0;
+
+// Timing in seconds. The HX711 runs at 10 samples per second, and the first
+// conversion after powering up is ready only after the filter has settled.
+// Waking up from power-down takes 16K clock cycles.
+const double HX711_SETTLING_S = 0.4;
+const double HX711_CONVERSION_S = 0.1;
+const double MCU_WAKEUP_S = 0.002;
+
+enum class PowerState {
+  AWAKE_DELAY,
+  AWAKE_WAITING_HX711,
+  AWAKE_WAKING_UP,
+  ASLEEP_INTERRUPT,
+  ASLEEP_WATCHDOG,
+  N_STATES
+};
+
+const char* describe(PowerState state);
+
+struct Sample {
+  double time;
+  float weight;
+};
+
+// A load cell trace is a CSV file with a time in seconds and a weight on each
+// line. The weight stays the same until the next sample. Lines starting with
+// # are comments.
+std::vector<Sample> loadTrace(const std::string& path);
+
+class Simulator {
+public:
+  static Simulator& instance();
+
+  void setTrace(std::vector<Sample> samples);
+  void setLedPin(int pin);
+
+  double now() const { return clock; }
+  double traceEnd() const;
+  float weightAt(double time);
+
+  unsigned long wakeups() const { return nWakeups; }
+  unsigned long readings() const { return nReadings; }
+  double lastReading() const { return lastReadingTime; }
+
+  double timeIn(PowerState state) const;
+  double chargeIn(PowerState state) const;
+  double hx711Time() const { return hx711OnTime; }
+  double hx711Charge() const { return hx711Mas / 3600; }
+  double ledTime() const { return ledOnTime; }
+  double ledCharge() const { return ledMas / 3600; }
+  double totalCharge() const;
+
+  // The hooks of the mock layers
+  void advance(double seconds, PowerState state);
+  void writePin(int pin, int value);
+  void attachInterrupt(int interrupt);
+  void detachInterrupt(int interrupt);
+  void powerDown(double seconds);
+  void powerDownUntilInterrupt();
+  void hx711Begin(int doutPin);
+  void hx711PowerUp();
+  void hx711PowerDown();
+  float hx711Read();
+
+private:
+  Simulator() = default;
+
+  double clock {};
+  std::vector<Sample> trace;
+  std::size_t traceIndex {};
+
+  int ledPin {-1};
+  bool ledOn {};
+  int attachedInterrupt {-1};
+  int hx711Interrupt {-1};
+  bool hx711On {};
+  double hx711ReadyAt {};
+
+  unsigned long nWakeups {};
+  unsigned long nReadings {};
+  double lastReadingTime {};
+
+  double stateTime[static_cast<int>(PowerState::N_STATES)] {};
+  double stateMas[static_cast<int>(PowerState::N_STATES)] {};
+  double hx711OnTime {};
+  double hx711Mas {};
+  double ledOnTime {};
+  double ledMas {};
+};
+
+}